@@ -7,50 +7,388 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/init.h>
+#include <linux/hash.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/rbtree.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/ioprio.h>
+#include <linux/iocontext.h>
+#include <linux/hrtimer.h>
 
-struct sstf_data {
+/*
+ * Batched dispatch: once a request has been picked, keep handing out its
+ * neighbours in the same direction while they sit within batch_gap sectors
+ * of the previous one and the run stays under batch_bytes. A batch_bytes of
+ * zero dispatches one request per call.
+ */
+static const int batch_bytes = 0;		/* max bytes per dispatched run */
+static const int batch_gap = 8;			/* max sector gap inside a run */
+
+/*
+ * Sync requests (reads and O_SYNC writes) and async requests (writeback)
+ * are kept in separate sorted queues. Sync is preferred, but async gets a
+ * turn after writes_starved sync picks so writeback can't be locked out.
+ */
+static const int writes_starved = 2;		/* max times async can be starved */
+
+/*
+ * Plugged dispatch: with a shallow queue there is little to choose from,
+ * so once requests start arriving into an empty scheduler, hold dispatch
+ * for a short window to let more gather before the head picks among them.
+ * The window adapts to the arrival rate: it is the time plug_depth
+ * requests are expected to take to arrive, capped at plug_usecs, and no
+ * window at all when requests come in slower than that. It closes early
+ * once plug_depth requests are queued or a realtime request shows up.
+ * A plug_usecs of zero disables it.
+ */
+static const int plug_usecs = 0;		/* max accumulation window, usecs */
+static const int plug_depth = 8;		/* queued requests that end it */
+
+/*
+ * I/O priority classes each get their own pair of queues. Realtime is
+ * always served first and preempts whatever the head was doing, best-effort
+ * comes next, and idle class requests only go out once the disk has seen
+ * no realtime or best-effort activity for idle_delay msecs.
+ */
+static const int idle_delay = 200;		/* quiet time before idle i/o, msecs */
+
+enum {
+	SSTF_PRIO_BE = 0,			/* also requests with no class */
+	SSTF_PRIO_RT,
+	SSTF_PRIO_IDLE,
+	SSTF_PRIO_NR,
+};
+
+/* the order classes are served in */
+static const int sstf_prio_order[SSTF_PRIO_NR] = {
+	SSTF_PRIO_RT, SSTF_PRIO_BE, SSTF_PRIO_IDLE,
+};
+
+static const char *sstf_prio_names[SSTF_PRIO_NR] = {
+	[SSTF_PRIO_BE]		= "BE",
+	[SSTF_PRIO_RT]		= "RT",
+	[SSTF_PRIO_IDLE]	= "Idle",
+};
+
+/*
+ * Zoned (host-managed SMR) disks need the writes within each zone to reach
+ * the drive in order. With zone_sectors set, a write is only dispatched if
+ * it is the lowest queued write in its zone and no other write to that
+ * zone is still in flight; otherwise the head goes to the nearest request
+ * that can go. Zero means the disk isn't zoned.
+ */
+static const int zone_sectors = 0;		/* zone size, sectors */
+
+#define SSTF_ZONE_SLOTS		64		/* max zones with a write in flight */
+
+/*
+ * Selection policies. SSTF picks whichever neighbour of the last request
+ * is closer. The others sweep the head in one direction: LOOK turns around
+ * at the last request, SCAN runs on to the edge of the disk before turning
+ * and C-LOOK jumps back to the lowest request and sweeps up again. All of
+ * them work off the same sorted queues.
+ */
+enum {
+	SSTF_POLICY_SSTF = 0,
+	SSTF_POLICY_SCAN,
+	SSTF_POLICY_LOOK,
+	SSTF_POLICY_CLOOK,
+	SSTF_POLICY_NR,
+};
+
+static const char *sstf_policy_names[SSTF_POLICY_NR] = {
+	[SSTF_POLICY_SSTF]	= "sstf",
+	[SSTF_POLICY_SCAN]	= "scan",
+	[SSTF_POLICY_LOOK]	= "look",
+	[SSTF_POLICY_CLOOK]	= "clook",
+};
+
+/*
+ * Per-process fairness: every process may dispatch proc_budget sectors per
+ * round. Once it has used its budget its requests are passed over while
+ * other processes still have budget left and requests queued; when nobody
+ * does, a new round starts and every budget is refilled. What a process
+ * has used is kept while it is idle, so one that never has much queued is
+ * still charged. Zero disables it.
+ */
+static const int proc_budget = 0;		/* sectors per process per round */
+
+/*
+ * Anticipation: when a process that issues dependent sync reads finishes
+ * one close to the head and has nothing else queued, hold the head for up
+ * to antic_expire msecs in case its next read lands nearby, instead of
+ * seeking away and straight back. Only done for processes whose mean think
+ * time fits inside the window. Zero disables it.
+ */
+static const int antic_expire = 0;		/* max idle time, msecs */
+
+#define SSTF_ANTIC_DIST		2048		/* max sectors from the head */
+
+#define SSTF_PROC_HASH_SHIFT	6
+#define SSTF_PROC_HASH_SIZE	(1 << SSTF_PROC_HASH_SHIFT)
+#define SSTF_PROC_IDLE_EXPIRE	(10 * HZ)	/* keep idle records this long */
+
+/*
+ * Budget state for one submitting process, shared by all its requests.
+ */
+struct sstf_proc {
+	struct hlist_node hash;
+	pid_t tgid;
+	int ref;
+	unsigned long idle_since;	/* jiffies the last reference went */
+
+	unsigned long round;
+	int used;
+	int queued;
+
+	/*
+	 * think time from a sync read completing to the next request,
+	 * averaged like cfq does (samples and totals scaled by 256)
+	 */
+	unsigned long last_end_us;
+	sector_t last_end_sect;
+	unsigned long ttime_samples;
+	unsigned long ttime_total;
+	unsigned long ttime_mean;
+};
+
+#define sstf_ttime_valid(proc)	((proc)->ttime_samples > 80)
+
+#define RQ_PROC(rq)	((struct sstf_proc *) (rq)->elevator_private[0])
+
+/*
+ * Time a request was added to its queue, in microseconds. Only differences
+ * are ever taken, so wrapping is harmless.
+ */
+#define RQ_ADD_TIME(rq)		((unsigned long) (rq)->elevator_private[1])
+#define rq_set_add_time(rq, us)	((rq)->elevator_private[1] = (void *) (us))
+
+/*
+ * Log2 histograms: bucket 0 counts zeros, bucket i counts values in
+ * [2^(i-1), 2^i), and the last bucket also takes everything larger.
+ */
+#define SSTF_HIST_BUCKETS	32
+
+/*
+ * Seek cost models, used wherever two candidates are compared by distance.
+ * linear and sqrt are fixed shapes of the sector distance. banded splits
+ * distances into the same log2 bands as the histograms and charges each
+ * band the measured mean service time of requests dispatched across such
+ * a seek, so short seeks that cost the same as none (or an SSD, where
+ * every band costs the same) compare as equal. constant treats every seek
+ * alike and leaves the order to the sweep direction.
+ *
+ * Scaling a monotonic shape can't change which neighbour is closer, so
+ * only the banded model has anything to learn from the measurements.
+ */
+enum {
+	SSTF_COST_LINEAR = 0,
+	SSTF_COST_SQRT,
+	SSTF_COST_BANDED,
+	SSTF_COST_CONSTANT,
+	SSTF_COST_NR,
+};
+
+static const char *sstf_cost_names[SSTF_COST_NR] = {
+	[SSTF_COST_LINEAR]	= "linear",
+	[SSTF_COST_SQRT]	= "sqrt",
+	[SSTF_COST_BANDED]	= "banded",
+	[SSTF_COST_CONSTANT]	= "constant",
+};
+
+/*
+ * While in the driver, elevator_private[1] holds the time the request was
+ * started. elevator_private[2] packs three bytes: the seek band it was
+ * dispatched across plus one, or zero if it shared the device with other
+ * requests and so makes a poor sample; the request's priority class; and
+ * the zone slot its write holds plus one.
+ */
+#define RQ_START_TIME(rq)	RQ_ADD_TIME(rq)
+#define rq_set_start_time(rq, us) rq_set_add_time(rq, us)
+#define RQ_PRIV2(rq)		((unsigned long) (rq)->elevator_private[2])
+#define RQ_PRIV2_GET(rq, shift)	((int) ((RQ_PRIV2(rq) >> (shift)) & 0xff))
+#define rq_priv2_set(rq, shift, v) ((rq)->elevator_private[2] = (void *) \
+		((RQ_PRIV2(rq) & ~(0xffUL << (shift))) | \
+		 ((unsigned long) (v) << (shift))))
+#define RQ_SEEK_BAND(rq)	RQ_PRIV2_GET(rq, 0)
+#define rq_set_seek_band(rq, b)	rq_priv2_set(rq, 0, b)
+#define RQ_PRIO(rq)		RQ_PRIV2_GET(rq, 8)
+#define rq_set_prio(rq, p)	rq_priv2_set(rq, 8, p)
+#define RQ_ZONE_SLOT(rq)	RQ_PRIV2_GET(rq, 16)
+#define rq_set_zone_slot(rq, z)	rq_priv2_set(rq, 16, z)
+#define RQ_QUEUE(nd, rq)	(&(nd)->queues[RQ_PRIO(rq)][rq_is_sync(rq)])
+
+/*
+ * One sector sorted queue, with its own SSTF position. The rbtree indexes
+ * the same requests by sector so inserts and head lookups don't have to
+ * walk the list with the queue lock held.
+ */
+struct sstf_queue {
+	struct rb_root sort_list;
 	struct list_head queue;
-	sector_t last_sect;
 	struct list_head* next_dispatch;
 	int queue_count;
 };
 
+struct sstf_data {
+	struct request_queue *q;
+
+	/*
+	 * requests are kept in a sorted queue per priority class and per
+	 * BLK_RW_SYNC/ASYNC
+	 */
+	struct sstf_queue queues[SSTF_PRIO_NR][2];
+	struct sstf_queue *last_queue;
+	sector_t last_sect;
+	int head_dir;
+	int starved[SSTF_PRIO_NR];
+
+	/*
+	 * last time realtime or best-effort i/o was queued or completed,
+	 * and the timer that lets idle class i/o out after that
+	 */
+	unsigned long last_busy;
+	struct timer_list idle_timer;
+
+	/*
+	 * zones with a write in flight, stored as zone number plus one
+	 */
+	sector_t zone_busy[SSTF_ZONE_SLOTS];
+
+	/*
+	 * accumulation window: requests queued in all classes, when the
+	 * current window opened and the mean gap between arrivals (usecs)
+	 */
+	int queued;
+	unsigned long plug_start;
+	unsigned long last_arrival;
+	unsigned long arrival_mean;
+	struct hrtimer plug_timer;
+
+	/*
+	 * per-process budgets, looked up by tgid
+	 */
+	struct hlist_head proc_hash[SSTF_PROC_HASH_SIZE];
+	unsigned long round;
+
+	/*
+	 * the process the head is being held for, if any
+	 */
+	struct sstf_proc *antic_proc;
+	struct timer_list antic_timer;
+	struct work_struct unplug_work;
+
+	/*
+	 * time spent queued (usecs) and seek distance (sectors) of
+	 * dispatched requests, per data direction
+	 */
+	unsigned long queue_hist[2][SSTF_HIST_BUCKETS];
+	unsigned long seek_hist[2][SSTF_HIST_BUCKETS];
+
+	/*
+	 * measured service time (usecs) per seek band, for the cost model
+	 */
+	unsigned long band_cost[SSTF_HIST_BUCKETS];
+	int in_flight;
+
+	/*
+	 * settings that change how the i/o scheduler behaves
+	 */
+	int policy;
+	int cost_model;
+	int batch_bytes;
+	int batch_gap;
+	int writes_starved;
+	int proc_budget;
+	int antic_expire;
+	int idle_delay;
+	int zone_sectors;
+	int plug_usecs;
+	int plug_depth;
+};
+
 
-static void sstf_print_list(struct request_queue *q)
+static inline int sstf_seek_band(unsigned long distance)
 {
-	struct sstf_data *nd = q->elevator->elevator_data;
+	int band = fls_long(distance);
 
-	struct list_head* pos_print;
-	struct request* print_node;
-	
-	printk("SSTF: Printing List: ");
-	list_for_each(pos_print, &nd->queue) {
-		print_node = list_entry(pos_print, struct request, queuelist);
-		printk("%lu,", (unsigned long)blk_rq_pos(print_node));
+	return band < SSTF_HIST_BUCKETS ? band : SSTF_HIST_BUCKETS - 1;
+}
+
+/*
+ * Cost of a seek band. Bands that haven't been measured yet borrow from
+ * the nearest measured band below them; with no measurements at all the
+ * band number itself keeps the order logarithmic in distance.
+ */
+static unsigned long sstf_band_cost(struct sstf_data *nd, int band)
+{
+	int b;
+
+	for(b = band; b >= 0; b--) {
+		if(nd->band_cost[b]) {
+			return nd->band_cost[b];
+		}
 	}
 
-	printk("\n");
+	return band;
+}
+
+/*
+ * Cost of moving the head distance sectors under the current model.
+ */
+static unsigned long sstf_seek_cost(struct sstf_data *nd, 
+				    unsigned long distance)
+{
+	switch(nd->cost_model) {
+		case SSTF_COST_SQRT:
+			return int_sqrt(distance);
+
+		case SSTF_COST_BANDED:
+			return sstf_band_cost(nd, sstf_seek_band(distance));
+
+		case SSTF_COST_CONSTANT:
+			return 0;
+
+		default:
+			return distance;
+	}
 }
 
-static void sstf_compare_seek(struct sstf_data *nd)
+static void sstf_compare_seek(struct sstf_data *nd, struct sstf_queue *sq)
 {	
 	//get pointers to requests
-	struct request* curr_request = list_entry(nd->next_dispatch, 
+	struct request* curr_request = list_entry(sq->next_dispatch, 
 		struct request, queuelist);
-	struct request* prev_request = list_entry(nd->next_dispatch->prev,
+	struct request* prev_request = list_entry(sq->next_dispatch->prev,
 		struct request, queuelist);
-	struct request* next_request = list_entry(nd->next_dispatch->next,
+	struct request* next_request = list_entry(sq->next_dispatch->next,
 		struct request, queuelist);
 	
-	//get sectors
-	unsigned long curr_sect = (unsigned long)blk_rq_pos(curr_request);
-	unsigned long prev_sect = (unsigned long)blk_rq_pos(prev_request);
-	unsigned long next_sect = (unsigned long)blk_rq_pos(next_request);
+	unsigned long curr_sect, prev_sect, next_sect;
 
 	//compare seek times
 	unsigned long seek_prev = 0;
 	unsigned long seek_next = 0;
 
+	//the list head is not a request, never pick it
+	if(sq->next_dispatch->prev == &sq->queue) {
+		sq->next_dispatch = sq->next_dispatch->next;
+		return;
+	}
+	if(sq->next_dispatch->next == &sq->queue) {
+		sq->next_dispatch = sq->next_dispatch->prev;
+		return;
+	}
+
+	//get sectors
+	curr_sect = (unsigned long)blk_rq_pos(curr_request);
+	prev_sect = (unsigned long)blk_rq_pos(prev_request);
+	next_sect = (unsigned long)blk_rq_pos(next_request);
+
 	if(prev_sect > curr_sect) {
 		seek_prev = prev_sect - curr_sect;
 	}
@@ -71,154 +409,1550 @@ static void sstf_compare_seek(struct sstf_data *nd)
 		seek_next = 0;
 	}
 
-	printk("SSTF: Seek Distance: Prev = %lu, Next = %lu\n", 
+	seek_prev = sstf_seek_cost(nd, seek_prev);
+	seek_next = sstf_seek_cost(nd, seek_next);
+
+	pr_debug("SSTF: Seek Cost: Prev = %lu, Next = %lu\n", 
 				seek_prev, seek_next);
 
 	//Dispatch the task (prev or next) with shortest seek time
 	if(seek_prev < seek_next) {
-		printk("SSTF: Dispatching Request 'Prev', Location: %lu\n", prev_sect);
-		nd->next_dispatch = nd->next_dispatch->prev;
+		pr_debug("SSTF: Dispatching Request 'Prev', Location: %lu\n", prev_sect);
+		sq->next_dispatch = sq->next_dispatch->prev;
 	}
 	else {
-		printk("SSTF: Dispatching Request 'Next', Location: %lu\n", next_sect);
-		nd->next_dispatch = nd->next_dispatch->next;
+		pr_debug("SSTF: Dispatching Request 'Next', Location: %lu\n", next_sect);
+		sq->next_dispatch = sq->next_dispatch->next;
 	}
 }
 
-static int sstf_merged_requests(struct request_queue *req_q, struct request *rq,
-			 struct bio *bio)
+/*
+ * Returns 1 if next continues the run ending at rq in direction dir
+ * (1 = towards higher sectors, -1 = towards lower sectors, 0 = either),
+ * with at most batch_gap sectors between them.
+ */
+static int sstf_rq_adjacent(struct sstf_data *nd, struct request *rq,
+			    struct request *next, int dir)
 {
-	return ELEVATOR_NO_MERGE;
+	sector_t rq_start = blk_rq_pos(rq);
+	sector_t next_start = blk_rq_pos(next);
+
+	if(dir >= 0 && next_start >= rq_start) {
+		return next_start <= rq_start + blk_rq_sectors(rq) 
+					+ nd->batch_gap;
+	}
+	if(dir <= 0 && next_start < rq_start) {
+		return next_start + blk_rq_sectors(next) + nd->batch_gap
+					>= rq_start;
+	}
+
+	return 0;
 }
 
-static int sstf_dispatch(struct request_queue *q, int force)
+/*
+ * Returns the lowest queued request at or past sector, or NULL if every
+ * request lies below it.
+ */
+static struct request *sstf_find_ceil(struct sstf_queue *sq, sector_t sector)
 {
-	printk("SSTF: Beginning Next Dispatch\n");
-	struct sstf_data *nd = q->elevator->elevator_data;
+	struct rb_node *node = sq->sort_list.rb_node;
+	struct request *ceil = NULL;
 
-	if(!list_empty(&nd->queue)) {
-		struct request *rq;
-		rq = list_entry(nd->next_dispatch, struct request, queuelist);
-	
-		if(rq == 0) {
-			printk("SSTF: Failed to Dispatch\n");
-			return 0;
-		}
+	while(node) {
+		struct request *rq = rb_entry_rq(node);
 
-		//If list contains only one item
-		if (nd->queue_count == 1) {
-			list_del_init(&rq->queuelist);
-			nd->queue_count--;
+		if(blk_rq_pos(rq) >= sector) {
+			ceil = rq;
+			node = node->rb_left;
 		}
-
-		//If list contains more than one item
 		else {
-			//compare seek times for nearest items
-			sstf_compare_seek(nd);
-			
-			//delete last request 
-			list_del_init(&rq->queuelist);
-			nd->queue_count--;
+			node = node->rb_right;
 		}
-		
-		printk("SSTF: Dispatching Request from Location: %lu\n", (unsigned long)blk_rq_pos(rq));
-		elv_dispatch_sort(q, rq);
+	}
 
-		printk("SSTF: Queue Count: %d\n", nd->queue_count);
+	return ceil;
+}
 
-		return 1;
-	}		
-	
-	return 0;
+/*
+ * Points the queue's next_dispatch at the request closest to sector. Used
+ * when the head comes back to a class after serving the other one, since
+ * the class' own position is stale by then.
+ */
+static void sstf_seek_nearest(struct sstf_data *nd, struct sstf_queue *sq,
+			      sector_t sector)
+{
+	struct request *above = sstf_find_ceil(sq, sector);
+	struct list_head *below;
+
+	if(!above) {
+		sq->next_dispatch = sq->queue.prev;
+		return;
+	}
+
+	sq->next_dispatch = &above->queuelist;
+
+	below = above->queuelist.prev;
+	if(below != &sq->queue && sstf_seek_cost(nd, sector - 
+			blk_rq_pos(list_entry(below, struct request, queuelist))) 
+			< sstf_seek_cost(nd, blk_rq_pos(above) - sector)) {
+		sq->next_dispatch = below;
+	}
 }
 
-static void sstf_add_request(struct request_queue *q, struct request *rq)
+/*
+ * Picks the queue to serve next within a priority class: sync first,
+ * unless async requests have been passed over writes_starved times in a
+ * row.
+ */
+static struct sstf_queue *sstf_choose_class(struct sstf_data *nd, int prio)
 {
-	struct sstf_data *nd = q->elevator->elevator_data;
-	int added = 0;
-	
-	printk("SSTF: Adding New Item, Location: %lu\n", (unsigned long)blk_rq_pos(rq) );
+	struct sstf_queue *sync = &nd->queues[prio][BLK_RW_SYNC];
+	struct sstf_queue *async = &nd->queues[prio][BLK_RW_ASYNC];
+
+	if(!list_empty(&sync->queue)) {
+		if(list_empty(&async->queue) ||
+		   nd->starved[prio]++ < nd->writes_starved) {
+			return sync;
+		}
+	}
 
-	sstf_print_list(q);
+	if(!list_empty(&async->queue)) {
+		nd->starved[prio] = 0;
+		return async;
+	}
 
-	if(list_empty(&nd->queue)) {
-		list_add(&rq->queuelist, &nd->queue);
-		nd->next_dispatch = nd->queue.next;
-		nd->queue_count++;
-		
-		sstf_print_list(q);
-		return;
+	return NULL;
+}
+
+static int sstf_prio_of(int ioprio_class)
+{
+	switch(ioprio_class) {
+		case IOPRIO_CLASS_RT:
+			return SSTF_PRIO_RT;
+
+		case IOPRIO_CLASS_IDLE:
+			return SSTF_PRIO_IDLE;
+
+		default:
+			return SSTF_PRIO_BE;
 	}
+}
 
-	struct list_head* pos;
-	list_for_each(pos, &nd->queue) {
-		struct request* curr_request = list_entry(pos, struct request, queuelist);
-		struct request* next_request = list_entry(pos->next, struct request, 
-			queuelist);
-		
-		sector_t curr_sect = blk_rq_pos(curr_request);
-		sector_t next_sect = blk_rq_pos(next_request);
-		sector_t new_sect  = blk_rq_pos(rq);
-
-		//if there's only one item in queue
-		if(nd->queue_count == 1) {
-			list_add(&rq->queuelist, pos);
-			nd->queue_count++;
-			added = 1;
-			
-			break;
+static int sstf_prio_queued(struct sstf_data *nd, int prio)
+{
+	return !list_empty(&nd->queues[prio][BLK_RW_SYNC].queue) ||
+	       !list_empty(&nd->queues[prio][BLK_RW_ASYNC].queue);
+}
+
+/*
+ * Picks the queue to serve next: the highest priority class with requests
+ * queued. Idle class requests wait until the disk has been quiet for
+ * idle_delay, with a timer set to come back then, unless we're draining.
+ */
+static struct sstf_queue *sstf_choose_queue(struct sstf_data *nd, int force)
+{
+	struct sstf_queue *sq;
+	unsigned long quiet;
+	int i;
+
+	for(i = 0; i < SSTF_PRIO_NR; i++) {
+		int prio = sstf_prio_order[i];
+
+		if(prio == SSTF_PRIO_IDLE && !force && 
+		   sstf_prio_queued(nd, prio)) {
+			quiet = nd->last_busy + msecs_to_jiffies(nd->idle_delay);
+			if(time_before(jiffies, quiet)) {
+				mod_timer(&nd->idle_timer, quiet);
+				return NULL;
+			}
 		}
 
-		//if there's multiple items in queue
-		if( (next_sect >= new_sect) && (curr_sect <= new_sect) ) {
-			list_add(&rq->queuelist, pos);
-			nd->queue_count++;
-			added = 1;
-			
-			break;
+		sq = sstf_choose_class(nd, prio);
+		if(sq) {
+			return sq;
 		}
 	}
 
-	//request is larger than all current requests
-	if(added != 1) {
-		list_add_tail(&rq->queuelist, &nd->queue);
-		nd->queue_count++;
+	return NULL;
+}
+
+/*
+ * End of the disk a request lives on, where SCAN turns the head around.
+ */
+static sector_t sstf_disk_edge(struct request *rq)
+{
+	if(rq->rq_disk) {
+		return get_capacity(rq->rq_disk);
 	}
 
-	printk("SSTF: Queue Count: %d\n", nd->queue_count);
-	sstf_print_list(q);
+	return blk_rq_pos(rq) + blk_rq_sectors(rq);
 }
 
-static void *sstf_init_queue(struct request_queue *q)
+/*
+ * Sweep selection for SCAN, LOOK and C-LOOK: the first request at or past
+ * last_sect in the head's direction of travel, turning around (or, for
+ * C-LOOK, wrapping to the lowest request) when there is nothing left ahead.
+ * Also points next_dispatch at the choice so a switch back to SSTF starts
+ * from there.
+ */
+static struct request *sstf_sweep_next(struct sstf_data *nd, 
+				       struct sstf_queue *sq)
 {
-	struct sstf_data *nd;
-	printk("SSTF: Initializing Queue\n");
+	struct request *rq = sstf_find_ceil(sq, nd->last_sect);
+	struct list_head *below;
+	struct list_head *above = NULL;
 
-	nd = kmalloc_node(sizeof(*nd), GFP_KERNEL, q->node);
-	if(!nd) return NULL;
+	//the list is in the same order, so below is just the one before
+	if(rq) {
+		above = &rq->queuelist;
+		below = above->prev;
+	}
+	else {
+		below = sq->queue.prev;
+	}
+	if(below == &sq->queue) {
+		below = NULL;
+	}
 
-	INIT_LIST_HEAD(&nd->queue);
-	nd->queue_count = 0;
-	return nd;
+	//a request right under the head costs nothing in either direction
+	if(above && blk_rq_pos(list_entry(above, struct request, queuelist)) 
+			== nd->last_sect) {
+		sq->next_dispatch = above;
+	}
+	else if(nd->head_dir >= 0) {
+		if(above) {
+			sq->next_dispatch = above;
+		}
+		else if(nd->policy == SSTF_POLICY_CLOOK) {
+			sq->next_dispatch = sq->queue.next;
+		}
+		else {
+			if(nd->policy == SSTF_POLICY_SCAN) {
+				nd->last_sect = sstf_disk_edge(list_entry(below,
+						struct request, queuelist));
+			}
+			nd->head_dir = -1;
+			sq->next_dispatch = below;
+		}
+	}
+	else {
+		if(below) {
+			sq->next_dispatch = below;
+		}
+		else {
+			if(nd->policy == SSTF_POLICY_SCAN) {
+				nd->last_sect = 0;
+			}
+			nd->head_dir = 1;
+			sq->next_dispatch = above;
+		}
+	}
+
+	return list_entry(sq->next_dispatch, struct request, queuelist);
 }
 
-static void sstf_exit_queue(struct elevator_queue *e)
+/*
+ * Returns 1 if the process that owns rq has used up its budget this round.
+ */
+static int sstf_proc_exhausted(struct sstf_data *nd, struct request *rq)
 {
-	struct sstf_data *nd = e->elevator_data;
-	printk("SSTF: Exiting Queue\n");	
+	struct sstf_proc *proc = RQ_PROC(rq);
 
-	BUG_ON(!list_empty(&nd->queue));
-	kfree(nd);
+	if(!proc || !nd->proc_budget) {
+		return 0;
+	}
+
+	return proc->round == nd->round && proc->used >= nd->proc_budget;
+}
+
+/*
+ * Charges a dispatched request against its process' budget.
+ */
+static void sstf_proc_charge(struct sstf_data *nd, struct request *rq)
+{
+	struct sstf_proc *proc = RQ_PROC(rq);
+
+	if(!proc) {
+		return;
+	}
+
+	if(proc->round != nd->round) {
+		proc->round = nd->round;
+		proc->used = 0;
+	}
+	proc->used += blk_rq_sectors(rq);
+}
+
+/*
+ * Drops a reference to a process' record. The record outlives its last
+ * request so a process that issues one read at a time keeps its think time
+ * and budget between them; sstf_proc_expire() frees it once it has been
+ * idle for a while. Called with the queue lock held.
+ */
+static void sstf_proc_put(struct sstf_proc *proc)
+{
+	if(--proc->ref == 0) {
+		proc->idle_since = jiffies;
+	}
+}
+
+/*
+ * Frees the records nobody has used for SSTF_PROC_IDLE_EXPIRE, or all idle
+ * ones if force is set. Called with the queue lock held.
+ */
+static void sstf_proc_expire(struct sstf_data *nd, int force)
+{
+	struct sstf_proc *proc;
+	struct hlist_node *n, *tmp;
+	int i;
+
+	for(i = 0; i < SSTF_PROC_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(proc, n, tmp, &nd->proc_hash[i], hash) {
+			if(proc->ref) {
+				continue;
+			}
+			if(!force && time_before(jiffies, 
+				proc->idle_since + SSTF_PROC_IDLE_EXPIRE)) {
+				continue;
+			}
+			hlist_del(&proc->hash);
+			kfree(proc);
+		}
+	}
+}
+
+static sector_t sstf_zone_of(struct sstf_data *nd, sector_t sector)
+{
+	sector_div(sector, nd->zone_sectors);
+	return sector;
+}
+
+/*
+ * Returns the slot tracking zone's in-flight write, or -1 if it has none.
+ * With zone == -1 (all ones) this finds a free slot instead.
+ */
+static int sstf_zone_slot(struct sstf_data *nd, sector_t zone)
+{
+	int i;
+
+	for(i = 0; i < SSTF_ZONE_SLOTS; i++) {
+		if(nd->zone_busy[i] == zone + 1) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the lowest write queued in zone in any class, or NULL if there
+ * is none. Only the zone's own requests are looked at.
+ */
+static struct request *sstf_zone_lowest_write(struct sstf_data *nd, 
+					      sector_t zone)
+{
+	sector_t zone_start = zone * nd->zone_sectors;
+	sector_t zone_end = zone_start + nd->zone_sectors;
+	struct request *curr_request, *lowest = NULL;
+	int i, j;
+
+	for(i = 0; i < SSTF_PRIO_NR; i++) {
+		for(j = 0; j < 2; j++) {
+			struct sstf_queue *sq = &nd->queues[i][j];
+
+			curr_request = sstf_find_ceil(sq, zone_start);
+			while(curr_request && 
+			      blk_rq_pos(curr_request) < zone_end) {
+				if(rq_data_dir(curr_request) == WRITE) {
+					if(!lowest || blk_rq_pos(curr_request)
+					   < blk_rq_pos(lowest)) {
+						lowest = curr_request;
+					}
+					break;
+				}
+
+				if(curr_request->queuelist.next == &sq->queue) {
+					break;
+				}
+				curr_request = list_entry(
+					curr_request->queuelist.next,
+					struct request, queuelist);
+			}
+		}
+	}
+
+	return lowest;
 }
 
+/*
+ * Remembers a zone's lowest write across the candidates of one search,
+ * which come in sector order, so each zone is only looked at once.
+ */
+struct sstf_zone_memo {
+	int valid;
+	sector_t zone;
+	struct request *lowest;
+};
+
+/*
+ * Returns 1 if rq may go to a zoned disk now: reads always may, a write
+ * only if it's next in its zone and the zone is idle. memo may be NULL.
+ */
+static int sstf_zone_ok(struct sstf_data *nd, struct request *rq,
+			struct sstf_zone_memo *memo)
+{
+	struct request *lowest;
+	sector_t zone;
+
+	if(!nd->zone_sectors || rq_data_dir(rq) != WRITE) {
+		return 1;
+	}
+
+	zone = sstf_zone_of(nd, blk_rq_pos(rq));
+	if(sstf_zone_slot(nd, zone) >= 0 || sstf_zone_slot(nd, -1) < 0) {
+		return 0;
+	}
+
+	if(memo && memo->valid && memo->zone == zone) {
+		lowest = memo->lowest;
+	}
+	else {
+		lowest = sstf_zone_lowest_write(nd, zone);
+		if(memo) {
+			memo->valid = 1;
+			memo->zone = zone;
+			memo->lowest = lowest;
+		}
+	}
+
+	return !lowest || blk_rq_pos(lowest) >= blk_rq_pos(rq);
+}
+
+/*
+ * Marks the zone of a dispatched write busy until it completes.
+ */
+static void sstf_zone_dispatch(struct sstf_data *nd, struct request *rq)
+{
+	int slot;
+
+	if(!nd->zone_sectors || rq_data_dir(rq) != WRITE) {
+		return;
+	}
+
+	//only full when draining ignored the limits, leave it untracked
+	slot = sstf_zone_slot(nd, -1);
+	if(slot < 0) {
+		return;
+	}
+
+	nd->zone_busy[slot] = sstf_zone_of(nd, blk_rq_pos(rq)) + 1;
+	rq_set_zone_slot(rq, slot + 1);
+}
+
+#define SSTF_CHECK_BUDGET	1
+#define SSTF_CHECK_ZONE		2
+
+/*
+ * Returns the request in sq nearest rq that passes the checks asked for,
+ * or NULL if there is none.
+ */
+static struct request *sstf_nearest_eligible(struct sstf_data *nd, 
+					     struct sstf_queue *sq,
+					     struct request *rq, int checks)
+{
+	struct list_head* pos;
+	struct request* best_request = NULL;
+	struct sstf_zone_memo memo = { 0 };
+	unsigned long best = 0;
+	sector_t from = blk_rq_pos(rq);
+
+	list_for_each(pos, &sq->queue) {
+		struct request *curr_request = list_entry(pos, struct request,
+					queuelist);
+		sector_t curr_sect = blk_rq_pos(curr_request);
+		unsigned long seek = sstf_seek_cost(nd, curr_sect > from ? 
+					curr_sect - from : from - curr_sect);
+
+		if((checks & SSTF_CHECK_BUDGET) && 
+		   sstf_proc_exhausted(nd, curr_request)) {
+			continue;
+		}
+		if((checks & SSTF_CHECK_ZONE) && 
+		   !sstf_zone_ok(nd, curr_request, &memo)) {
+			continue;
+		}
+
+		if(!best_request || seek < best) {
+			best_request = curr_request;
+			best = seek;
+		}
+	}
+
+	return best_request;
+}
+
+/*
+ * Returns the next request to dispatch from sq under the current policy,
+ * or NULL if nothing in it can go yet. If the policy's pick belongs to a
+ * process that is out of budget, the head goes to the request nearest it
+ * from a process that still has budget, or a new round starts if there is
+ * none. A write the zone rules hold back is passed over the same way.
+ * If every request in sq is held back, the lower write holding back the
+ * pick goes instead, whatever queue it's in, so the zone can't stall
+ * with nothing in flight. Draining skips the zone rules.
+ */
+static struct request *sstf_next_request(struct sstf_data *nd,
+					 struct sstf_queue *sq, int force)
+{
+	const int zone_check = force ? 0 : SSTF_CHECK_ZONE;
+	struct request *rq, *alt;
+
+	if(nd->policy == SSTF_POLICY_SSTF) {
+		rq = list_entry(sq->next_dispatch, struct request, queuelist);
+	}
+	else {
+		rq = sstf_sweep_next(nd, sq);
+	}
+
+	if(sstf_proc_exhausted(nd, rq)) {
+		alt = sstf_nearest_eligible(nd, sq, rq, 
+					    SSTF_CHECK_BUDGET | zone_check);
+		if(alt) {
+			rq = alt;
+		}
+		else {
+			pr_debug("SSTF: All Budgets Used, Starting Round %lu\n", 
+						nd->round + 1);
+			nd->round++;
+		}
+	}
+
+	if(zone_check && !sstf_zone_ok(nd, rq, NULL)) {
+		alt = sstf_nearest_eligible(nd, sq, rq, zone_check);
+		if(!alt) {
+			//a busy zone or no free slot means a write is in
+			//flight, and its completion runs the queue again
+			alt = sstf_zone_lowest_write(nd, 
+					sstf_zone_of(nd, blk_rq_pos(rq)));
+			if(!alt || !sstf_zone_ok(nd, alt, NULL)) {
+				return NULL;
+			}
+			RQ_QUEUE(nd, alt)->next_dispatch = &alt->queuelist;
+			return alt;
+		}
+		rq = alt;
+	}
+
+	sq->next_dispatch = &rq->queuelist;
+	return rq;
+}
+
+/*
+ * Everything sstf_choose_queue() picked is held back by busy zones. Rather
+ * than leave the disk idle until those writes complete, serve the next
+ * queue that has something that can go, in the usual class order. Idle
+ * class requests still wait out idle_delay.
+ */
+static struct request *sstf_next_elsewhere(struct sstf_data *nd,
+					   struct sstf_queue *skip)
+{
+	unsigned long quiet = nd->last_busy + msecs_to_jiffies(nd->idle_delay);
+	struct sstf_queue *sq;
+	struct request *rq;
+	int i, sync;
+
+	for(i = 0; i < SSTF_PRIO_NR; i++) {
+		int prio = sstf_prio_order[i];
+
+		if(prio == SSTF_PRIO_IDLE && time_before(jiffies, quiet)) {
+			break;
+		}
+
+		for(sync = BLK_RW_SYNC; sync >= BLK_RW_ASYNC; sync--) {
+			sq = &nd->queues[prio][sync];
+			if(sq == skip || list_empty(&sq->queue)) {
+				continue;
+			}
+
+			//the head is wherever the last queue left it
+			sstf_seek_nearest(nd, sq, nd->last_sect);
+			nd->last_queue = sq;
+			rq = sstf_next_request(nd, sq, 0);
+			if(rq) {
+				return rq;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static inline unsigned long sstf_now_us(void)
+{
+	return (unsigned long) ktime_to_us(ktime_get());
+}
+
+static void sstf_hist_add(unsigned long *hist, unsigned long val)
+{
+	hist[sstf_seek_band(val)]++;
+}
+
+/*
+ * Records how long rq sat in its queue and how far the head had to move
+ * to reach it. Called before last_sect is advanced past rq.
+ */
+static void sstf_account_dispatch(struct sstf_data *nd, struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+	sector_t pos = blk_rq_pos(rq);
+	unsigned long distance = pos > nd->last_sect ? pos - nd->last_sect :
+					nd->last_sect - pos;
+
+	sstf_hist_add(nd->queue_hist[data_dir], sstf_now_us() - RQ_ADD_TIME(rq));
+	sstf_hist_add(nd->seek_hist[data_dir], distance);
+	rq_set_seek_band(rq, sstf_seek_band(distance) + 1);
+}
+
+/*
+ * Stops holding the head. Called with the queue lock held, so the timer
+ * can't be waited for here; its handler finds antic_proc already cleared.
+ */
+static void sstf_antic_stop(struct sstf_data *nd)
+{
+	if(!nd->antic_proc) {
+		return;
+	}
+
+	del_timer(&nd->antic_timer);
+	sstf_proc_put(nd->antic_proc);
+	nd->antic_proc = NULL;
+}
+
+/*
+ * A sync read from proc just completed. Start holding the head for it if
+ * it ended near the head, the process has nothing else queued and it
+ * usually comes back within the window.
+ */
+static void sstf_antic_start(struct sstf_data *nd, struct sstf_proc *proc)
+{
+	sector_t end = proc->last_end_sect;
+	sector_t distance = end > nd->last_sect ? end - nd->last_sect :
+					nd->last_sect - end;
+
+	if(!nd->antic_expire || nd->antic_proc || proc->queued) {
+		return;
+	}
+
+	if(distance > SSTF_ANTIC_DIST || !sstf_ttime_valid(proc) ||
+	   proc->ttime_mean > nd->antic_expire * USEC_PER_MSEC) {
+		return;
+	}
+
+	proc->ref++;
+	nd->antic_proc = proc;
+	mod_timer(&nd->antic_timer, 
+		  jiffies + msecs_to_jiffies(nd->antic_expire));
+}
+
+/*
+ * The window ran out without the process coming back. The queue was left
+ * alone while the head was held, so kick it to get dispatching again.
+ */
+static void sstf_antic_timeout(unsigned long data)
+{
+	struct sstf_data *nd = (struct sstf_data *) data;
+	unsigned long flags;
+
+	spin_lock_irqsave(nd->q->queue_lock, flags);
+	if(nd->antic_proc) {
+		sstf_antic_stop(nd);
+		kblockd_schedule_work(nd->q, &nd->unplug_work);
+	}
+	spin_unlock_irqrestore(nd->q->queue_lock, flags);
+}
+
+/*
+ * The disk has been quiet long enough for idle class requests to go.
+ */
+static void sstf_idle_timeout(unsigned long data)
+{
+	struct sstf_data *nd = (struct sstf_data *) data;
+	unsigned long flags;
+
+	spin_lock_irqsave(nd->q->queue_lock, flags);
+	kblockd_schedule_work(nd->q, &nd->unplug_work);
+	spin_unlock_irqrestore(nd->q->queue_lock, flags);
+}
+
+static void sstf_kick_queue(struct work_struct *work)
+{
+	struct sstf_data *nd = container_of(work, struct sstf_data, 
+					    unplug_work);
+	struct request_queue *q = nd->q;
+
+	spin_lock_irq(q->queue_lock);
+	__blk_run_queue(q);
+	spin_unlock_irq(q->queue_lock);
+}
+
+/*
+ * Time from the process' last sync read completion to this request.
+ */
+static void sstf_update_thinktime(struct sstf_data *nd, 
+				  struct sstf_proc *proc)
+{
+	unsigned long ttime;
+
+	if(!proc->last_end_us) {
+		return;
+	}
+
+	ttime = sstf_now_us() - proc->last_end_us;
+	ttime = min_t(unsigned long, ttime, 
+		      2 * nd->antic_expire * USEC_PER_MSEC);
+
+	proc->ttime_samples = (7 * proc->ttime_samples + 256) / 8;
+	proc->ttime_total = (7 * proc->ttime_total + 256 * ttime) / 8;
+	proc->ttime_mean = (proc->ttime_total + 128) / proc->ttime_samples;
+}
+
+/*
+ * Folds the gap since the previous arrival into the mean, and opens a new
+ * window if this request is the first in an empty scheduler.
+ */
+static void sstf_plug_arrival(struct sstf_data *nd)
+{
+	unsigned long now = sstf_now_us();
+	unsigned long gap = now - nd->last_arrival;
+
+	gap = min_t(unsigned long, gap, 2 * nd->plug_usecs);
+	nd->arrival_mean = (7 * nd->arrival_mean + gap) / 8;
+	nd->last_arrival = now;
+
+	if(nd->queued++ == 0) {
+		nd->plug_start = now;
+	}
+}
+
+/*
+ * Length of the window at the current arrival rate, in usecs.
+ */
+static unsigned long sstf_plug_window(struct sstf_data *nd)
+{
+	unsigned long window;
+
+	if(!nd->plug_usecs || nd->arrival_mean >= nd->plug_usecs) {
+		return 0;
+	}
+
+	window = nd->arrival_mean * (nd->plug_depth > 1 ? 
+				     nd->plug_depth - 1 : 1);
+	return min_t(unsigned long, window, nd->plug_usecs);
+}
+
+/*
+ * Returns 1 if dispatch should wait for more requests to gather, with the
+ * timer set for when the window closes.
+ */
+static int sstf_plugged(struct sstf_data *nd)
+{
+	unsigned long window = sstf_plug_window(nd);
+	unsigned long waited;
+
+	if(!window || !nd->queued || nd->queued >= nd->plug_depth) {
+		return 0;
+	}
+
+	if(sstf_prio_queued(nd, SSTF_PRIO_RT)) {
+		return 0;
+	}
+
+	waited = sstf_now_us() - nd->plug_start;
+	if(waited >= window) {
+		return 0;
+	}
+
+	hrtimer_start(&nd->plug_timer, 
+		      ns_to_ktime((u64) (window - waited) * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+	return 1;
+}
+
+/*
+ * The window closed. This runs in interrupt context, so leave the
+ * dispatching to kblockd.
+ */
+static enum hrtimer_restart sstf_plug_timeout(struct hrtimer *timer)
+{
+	struct sstf_data *nd = container_of(timer, struct sstf_data, 
+					    plug_timer);
+
+	kblockd_schedule_work(nd->q, &nd->unplug_work);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * The driver has taken the request. It's only a clean calibration sample
+ * if nothing else is in flight to share the device with.
+ */
+static void sstf_activate_request(struct request_queue *q, struct request *rq)
+{
+	struct sstf_data *nd = q->elevator->elevator_data;
+
+	if(nd->in_flight++) {
+		rq_set_seek_band(rq, 0);
+	}
+	rq_set_start_time(rq, sstf_now_us());
+}
+
+static void sstf_deactivate_request(struct request_queue *q, 
+				    struct request *rq)
+{
+	struct sstf_data *nd = q->elevator->elevator_data;
+
+	nd->in_flight--;
+	rq_set_seek_band(rq, 0);
+}
+
+/*
+ * Folds the service time of a completed request into its band's cost,
+ * as a moving average weighted 7/8 towards the old value.
+ */
+static void sstf_completed_request(struct request_queue *q, struct request *rq)
+{
+	struct sstf_data *nd = q->elevator->elevator_data;
+	struct sstf_proc *proc = RQ_PROC(rq);
+	unsigned long service;
+	int band = RQ_SEEK_BAND(rq);
+
+	nd->in_flight--;
+
+	if(RQ_PRIO(rq) != SSTF_PRIO_IDLE) {
+		nd->last_busy = jiffies;
+	}
+
+	//the zone can take its next write now
+	if(RQ_ZONE_SLOT(rq)) {
+		nd->zone_busy[RQ_ZONE_SLOT(rq) - 1] = 0;
+		rq_set_zone_slot(rq, 0);
+		kblockd_schedule_work(q, &nd->unplug_work);
+	}
+
+	if(proc && rq_is_sync(rq) && rq_data_dir(rq) == READ) {
+		proc->last_end_us = sstf_now_us();
+		proc->last_end_sect = blk_rq_pos(rq) + blk_rq_sectors(rq);
+		sstf_antic_start(nd, proc);
+	}
+
+	if(!band--) {
+		return;
+	}
+
+	service = sstf_now_us() - RQ_START_TIME(rq);
+	if(!service) {
+		service = 1;
+	}
+
+	if(nd->band_cost[band]) {
+		nd->band_cost[band] = (7 * nd->band_cost[band] + service) / 8;
+	}
+	else {
+		nd->band_cost[band] = service;
+	}
+}
+
+static int sstf_merged_requests(struct request_queue *req_q, struct request *rq,
+			 struct bio *bio)
+{
+	return ELEVATOR_NO_MERGE;
+}
+
+/*
+ * This kernel's sort tree holds one request per sector, so requests at a
+ * sector already queued only go on the list, right behind the one in
+ * the tree, see sstf_add_request(). Takes rq out of the tree, if it's
+ * in it, and puts the next request at its sector in its place.
+ */
+static void sstf_rb_del(struct sstf_queue *sq, struct request *rq)
+{
+	struct request *next;
+
+	if(RB_EMPTY_NODE(&rq->rb_node)) {
+		return;
+	}
+
+	elv_rb_del(&sq->sort_list, rq);
+	if(rq->queuelist.next != &sq->queue) {
+		next = list_entry(rq->queuelist.next, struct request, queuelist);
+		if(blk_rq_pos(next) == blk_rq_pos(rq)) {
+			elv_rb_add(&sq->sort_list, next);
+		}
+	}
+}
+
+static int sstf_dispatch(struct request_queue *q, int force)
+{
+	struct sstf_data *nd = q->elevator->elevator_data;
+	struct sstf_queue *sq;
+	struct request *rq, *next;
+	int dispatched = 0;
+	unsigned int bytes = 0;
+	int dir = 0;
+
+	pr_debug("SSTF: Beginning Next Dispatch\n");
+
+	//hold the head for the anticipated process, unless draining
+	if(nd->antic_proc) {
+		if(!force) {
+			return 0;
+		}
+		sstf_antic_stop(nd);
+	}
+
+	//let more requests gather first, unless draining
+	if(!force && sstf_plugged(nd)) {
+		return 0;
+	}
+
+	sq = sstf_choose_queue(nd, force);
+	if(!sq) {
+		return 0;
+	}
+
+	//the head moved while the other class was served
+	if(sq != nd->last_queue) {
+		sstf_seek_nearest(nd, sq, nd->last_sect);
+		nd->last_queue = sq;
+	}
+
+	rq = sstf_next_request(nd, sq, force);
+	if(!rq) {
+		//only the zone rules hold requests back, and not when draining
+		rq = sstf_next_elsewhere(nd, sq);
+		if(!rq) {
+			return 0;
+		}
+	}
+
+	while(1) {
+		//a write holding back the zone may come from another queue
+		sq = RQ_QUEUE(nd, rq);
+
+		//If list contains more than one item
+		if (nd->policy == SSTF_POLICY_SSTF && sq->queue_count > 1) {
+			//compare seek times for nearest items
+			sstf_compare_seek(nd, sq);
+		}
+
+		//delete last request 
+		sstf_rb_del(sq, rq);
+		list_del_init(&rq->queuelist);
+		sq->queue_count--;
+
+		pr_debug("SSTF: Dispatching Request from Location: %lu\n", (unsigned long)blk_rq_pos(rq));
+		//in the order chosen, a downward run mustn't be re-sorted
+		elv_dispatch_add_tail(q, rq);
+		sstf_account_dispatch(nd, rq);
+		sstf_zone_dispatch(nd, rq);
+		sstf_proc_charge(nd, rq);
+		if(RQ_PROC(rq)) {
+			RQ_PROC(rq)->queued--;
+		}
+		nd->queued--;
+		nd->last_sect = blk_rq_pos(rq) + blk_rq_sectors(rq);
+		bytes += blk_rq_bytes(rq);
+		dispatched++;
+
+		//keep going while the nearest request extends the current run
+		if(list_empty(&sq->queue) || !nd->batch_bytes) {
+			break;
+		}
+
+		next = sstf_next_request(nd, sq, force);
+		if(!next || !sstf_rq_adjacent(nd, rq, next, dir) ||
+		   bytes + blk_rq_bytes(next) > nd->batch_bytes) {
+			break;
+		}
+
+		dir = blk_rq_pos(next) >= blk_rq_pos(rq) ? 1 : -1;
+		rq = next;
+	}
+
+	pr_debug("SSTF: Dispatched %d %s %s Request(s), %u Bytes, Queue Count: %d\n",
+				dispatched, sstf_prio_names[RQ_PRIO(rq)], 
+				rq_is_sync(rq) ? "Sync" : "Async", 
+				bytes, sq->queue_count);
+
+	return dispatched;
+}
+
+static void sstf_add_request(struct request_queue *q, struct request *rq)
+{
+	struct sstf_data *nd = q->elevator->elevator_data;
+	struct sstf_queue *sq;
+	struct sstf_proc *proc = RQ_PROC(rq);
+	struct list_head *pos = NULL;
+	struct request *alias;
+	struct rb_node *prev;
+
+	rq_set_add_time(rq, sstf_now_us());
+	sstf_plug_arrival(nd);
+
+	//a class set on the bio itself wins over the submitter's
+	if(ioprio_valid(rq->ioprio)) {
+		rq_set_prio(rq, sstf_prio_of(IOPRIO_PRIO_CLASS(rq->ioprio)));
+	}
+	sq = RQ_QUEUE(nd, rq);
+
+	if(RQ_PRIO(rq) != SSTF_PRIO_IDLE) {
+		nd->last_busy = jiffies;
+	}
+
+	//realtime preempts the current sweep: stop holding the head for
+	//anyone else, the dispatch after this re-aims at the realtime queue
+	if(RQ_PRIO(rq) == SSTF_PRIO_RT && nd->antic_proc && 
+	   nd->antic_proc != proc) {
+		sstf_antic_stop(nd);
+	}
+
+	if(proc) {
+		proc->queued++;
+		if(rq_is_sync(rq)) {
+			sstf_update_thinktime(nd, proc);
+		}
+
+		//the process we were waiting for is back, resume from the 
+		//head so its request gets picked up
+		if(proc == nd->antic_proc) {
+			sstf_antic_stop(nd);
+			nd->last_queue = NULL;
+		}
+	}
+
+	//the tree finds the request to insert behind. A request at a sector
+	//that's already in the tree isn't linked, and stays out of it until
+	//it's the first there again, see sstf_rb_del()
+	alias = elv_rb_add(&sq->sort_list, rq);
+	if(alias) {
+		RB_CLEAR_NODE(&rq->rb_node);
+		pos = &alias->queuelist;
+	}
+	else {
+		prev = rb_prev(&rq->rb_node);
+		if(prev) {
+			pos = &rb_entry_rq(prev)->queuelist;
+		}
+	}
+
+	//behind any others at the same sector, keeping arrival order
+	if(pos) {
+		while(pos->next != &sq->queue && 
+		      blk_rq_pos(list_entry(pos->next, struct request, 
+					    queuelist)) == 
+		      blk_rq_pos(list_entry(pos, struct request, queuelist))) {
+			pos = pos->next;
+		}
+		list_add(&rq->queuelist, pos);
+	}
+	else {
+		list_add(&rq->queuelist, &sq->queue);
+	}
+
+	if(sq->queue_count++ == 0) {
+		sq->next_dispatch = &rq->queuelist;
+	}
+}
+
+static struct sstf_proc *sstf_proc_find(struct sstf_data *nd, pid_t tgid)
+{
+	struct sstf_proc *proc;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(proc, n, 
+		&nd->proc_hash[hash_long(tgid, SSTF_PROC_HASH_SHIFT)], hash) {
+		if(proc->tgid == tgid) {
+			return proc;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Attaches the submitting process' budget to a newly allocated request.
+ * Called without the queue lock held.
+ */
+static int sstf_set_request(struct request_queue *q, struct request *rq,
+			    gfp_t gfp_mask)
+{
+	struct sstf_data *nd = q->elevator->elevator_data;
+	struct sstf_proc *proc, *new_proc;
+	pid_t tgid = current->tgid;
+	unsigned long flags;
+
+	might_sleep_if(gfp_mask & __GFP_WAIT);
+
+	//the class the submitter was given with ioprio_set()
+	if(current->io_context) {
+		rq_set_prio(rq, sstf_prio_of(
+				task_ioprio_class(current->io_context)));
+	}
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	proc = sstf_proc_find(nd, tgid);
+	if(proc) {
+		proc->ref++;
+		rq->elevator_private[0] = proc;
+		spin_unlock_irqrestore(q->queue_lock, flags);
+		return 0;
+	}
+	spin_unlock_irqrestore(q->queue_lock, flags);
+
+	new_proc = kmalloc_node(sizeof(*new_proc), gfp_mask, q->node);
+	if(!new_proc) {
+		return 1;
+	}
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	//somebody may have added it while we were allocating
+	proc = sstf_proc_find(nd, tgid);
+	if(!proc) {
+		//a new process is a good time to drop the ones that went away
+		sstf_proc_expire(nd, 0);
+
+		proc = new_proc;
+		new_proc = NULL;
+		proc->tgid = tgid;
+		proc->ref = 0;
+		proc->idle_since = jiffies;
+		proc->round = nd->round;
+		proc->used = 0;
+		proc->queued = 0;
+		proc->last_end_us = 0;
+		proc->last_end_sect = 0;
+		proc->ttime_samples = 0;
+		proc->ttime_total = 0;
+		proc->ttime_mean = 0;
+		hlist_add_head(&proc->hash, 
+			&nd->proc_hash[hash_long(tgid, SSTF_PROC_HASH_SHIFT)]);
+	}
+	proc->ref++;
+	rq->elevator_private[0] = proc;
+	spin_unlock_irqrestore(q->queue_lock, flags);
+
+	kfree(new_proc);
+	return 0;
+}
+
+/*
+ * Drops the request's hold on its process' budget. Called with the queue
+ * lock held.
+ */
+static void sstf_put_request(struct request *rq)
+{
+	struct sstf_proc *proc = RQ_PROC(rq);
+
+	if(!proc) {
+		return;
+	}
+
+	rq->elevator_private[0] = NULL;
+	sstf_proc_put(proc);
+}
+
+static void *sstf_init_queue(struct request_queue *q)
+{
+	struct sstf_data *nd;
+	int i, j;
+	printk("SSTF: Initializing Queue\n");
+
+	nd = kmalloc_node(sizeof(*nd), GFP_KERNEL, q->node);
+	if(!nd) return NULL;
+
+	for(i = 0; i < SSTF_PRIO_NR; i++) {
+		for(j = 0; j < 2; j++) {
+			nd->queues[i][j].sort_list = RB_ROOT;
+			INIT_LIST_HEAD(&nd->queues[i][j].queue);
+			nd->queues[i][j].queue_count = 0;
+		}
+		nd->starved[i] = 0;
+	}
+	nd->q = q;
+	nd->last_queue = NULL;
+	nd->last_sect = 0;
+	nd->head_dir = 1;
+	nd->last_busy = jiffies;
+	init_timer(&nd->idle_timer);
+	nd->idle_timer.function = sstf_idle_timeout;
+	nd->idle_timer.data = (unsigned long) nd;
+	memset(nd->zone_busy, 0, sizeof(nd->zone_busy));
+	nd->queued = 0;
+	nd->plug_start = 0;
+	nd->last_arrival = sstf_now_us();
+	nd->arrival_mean = 0;
+	hrtimer_init(&nd->plug_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	nd->plug_timer.function = sstf_plug_timeout;
+	for(i = 0; i < SSTF_PROC_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&nd->proc_hash[i]);
+	}
+	nd->round = 0;
+	nd->antic_proc = NULL;
+	init_timer(&nd->antic_timer);
+	nd->antic_timer.function = sstf_antic_timeout;
+	nd->antic_timer.data = (unsigned long) nd;
+	INIT_WORK(&nd->unplug_work, sstf_kick_queue);
+	memset(nd->queue_hist, 0, sizeof(nd->queue_hist));
+	memset(nd->seek_hist, 0, sizeof(nd->seek_hist));
+	memset(nd->band_cost, 0, sizeof(nd->band_cost));
+	nd->in_flight = 0;
+	nd->policy = SSTF_POLICY_SSTF;
+	nd->cost_model = SSTF_COST_LINEAR;
+	nd->batch_bytes = batch_bytes;
+	nd->batch_gap = batch_gap;
+	nd->writes_starved = writes_starved;
+	nd->proc_budget = proc_budget;
+	nd->antic_expire = antic_expire;
+	nd->idle_delay = idle_delay;
+	nd->zone_sectors = zone_sectors;
+	nd->plug_usecs = plug_usecs;
+	nd->plug_depth = plug_depth;
+	return nd;
+}
+
+static void sstf_exit_queue(struct elevator_queue *e)
+{
+	struct sstf_data *nd = e->elevator_data;
+	int i;
+	printk("SSTF: Exiting Queue\n");	
+
+	del_timer_sync(&nd->antic_timer);
+	del_timer_sync(&nd->idle_timer);
+	hrtimer_cancel(&nd->plug_timer);
+	cancel_work_sync(&nd->unplug_work);
+	if(nd->antic_proc) {
+		sstf_proc_put(nd->antic_proc);
+	}
+
+	for(i = 0; i < SSTF_PRIO_NR; i++) {
+		BUG_ON(sstf_prio_queued(nd, i));
+	}
+	//every request is gone, so every record is idle by now
+	sstf_proc_expire(nd, 1);
+	for(i = 0; i < SSTF_PROC_HASH_SIZE; i++) {
+		BUG_ON(!hlist_empty(&nd->proc_hash[i]));
+	}
+	kfree(nd);
+}
+
+/*
+ * sysfs parts below
+ */
+static ssize_t
+sstf_var_show(int var, char *page)
+{
+	return sprintf(page, "%d\n", var);
+}
+
+static ssize_t
+sstf_var_store(int *var, const char *page, size_t count)
+{
+	char *p = (char *) page;
+
+	*var = simple_strtol(p, &p, 10);
+	return count;
+}
+
+#define SHOW_FUNCTION(__FUNC, __VAR)					\
+static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
+{									\
+	struct sstf_data *nd = e->elevator_data;			\
+	return sstf_var_show(__VAR, (page));				\
+}
+SHOW_FUNCTION(sstf_batch_bytes_show, nd->batch_bytes);
+SHOW_FUNCTION(sstf_batch_gap_show, nd->batch_gap);
+SHOW_FUNCTION(sstf_writes_starved_show, nd->writes_starved);
+SHOW_FUNCTION(sstf_proc_budget_show, nd->proc_budget);
+SHOW_FUNCTION(sstf_antic_expire_show, nd->antic_expire);
+SHOW_FUNCTION(sstf_idle_delay_show, nd->idle_delay);
+SHOW_FUNCTION(sstf_zone_sectors_show, nd->zone_sectors);
+SHOW_FUNCTION(sstf_plug_usecs_show, nd->plug_usecs);
+SHOW_FUNCTION(sstf_plug_depth_show, nd->plug_depth);
+#undef SHOW_FUNCTION
+
+#define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX)				\
+static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)	\
+{									\
+	struct sstf_data *nd = e->elevator_data;			\
+	int __data;							\
+	int ret = sstf_var_store(&__data, (page), count);		\
+	if (__data < (MIN))						\
+		__data = (MIN);						\
+	else if (__data > (MAX))					\
+		__data = (MAX);						\
+	*(__PTR) = __data;						\
+	return ret;							\
+}
+STORE_FUNCTION(sstf_batch_bytes_store, &nd->batch_bytes, 0, INT_MAX);
+STORE_FUNCTION(sstf_batch_gap_store, &nd->batch_gap, 0, INT_MAX);
+STORE_FUNCTION(sstf_writes_starved_store, &nd->writes_starved, INT_MIN, INT_MAX);
+STORE_FUNCTION(sstf_proc_budget_store, &nd->proc_budget, 0, INT_MAX);
+STORE_FUNCTION(sstf_antic_expire_store, &nd->antic_expire, 0, 1000);
+STORE_FUNCTION(sstf_idle_delay_store, &nd->idle_delay, 0, INT_MAX);
+STORE_FUNCTION(sstf_plug_usecs_store, &nd->plug_usecs, 0, 100000);
+STORE_FUNCTION(sstf_plug_depth_store, &nd->plug_depth, 1, INT_MAX);
+#undef STORE_FUNCTION
+
+/*
+ * Settings chosen by name read back like the queue's scheduler file, with
+ * the current one in brackets.
+ */
+static ssize_t sstf_names_show(const char **names, int nr, int cur, char *page)
+{
+	int len = 0;
+	int i;
+
+	for(i = 0; i < nr; i++) {
+		if(i == cur) {
+			len += sprintf(page + len, "[%s] ", names[i]);
+		}
+		else {
+			len += sprintf(page + len, "%s ", names[i]);
+		}
+	}
+
+	len += sprintf(page + len, "\n");
+	return len;
+}
+
+static int sstf_names_find(const char **names, int nr, const char *page)
+{
+	char name[16];
+	char *p;
+	int i;
+
+	strlcpy(name, page, sizeof(name));
+	p = strim(name);
+
+	for(i = 0; i < nr; i++) {
+		if(!strcmp(p, names[i])) {
+			return i;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static ssize_t sstf_policy_show(struct elevator_queue *e, char *page)
+{
+	struct sstf_data *nd = e->elevator_data;
+	return sstf_names_show(sstf_policy_names, SSTF_POLICY_NR, 
+				nd->policy, page);
+}
+
+/*
+ * The policy can change while requests are queued. The queues stay sorted
+ * the same way, so all that's needed is to forget the old position and
+ * re-aim at the request nearest the head on the next dispatch.
+ */
+static ssize_t sstf_policy_store(struct elevator_queue *e, const char *page,
+				 size_t count)
+{
+	struct sstf_data *nd = e->elevator_data;
+	int i = sstf_names_find(sstf_policy_names, SSTF_POLICY_NR, page);
+
+	if(i < 0) {
+		return i;
+	}
+
+	spin_lock_irq(nd->q->queue_lock);
+	nd->policy = i;
+	nd->last_queue = NULL;
+	spin_unlock_irq(nd->q->queue_lock);
+
+	return count;
+}
+
+/*
+ * The model decides which neighbour is nearer, so like the policy it
+ * re-aims the queues from the head on the next dispatch.
+ */
+static ssize_t sstf_cost_model_show(struct elevator_queue *e, char *page)
+{
+	struct sstf_data *nd = e->elevator_data;
+	return sstf_names_show(sstf_cost_names, SSTF_COST_NR, 
+				nd->cost_model, page);
+}
+
+static ssize_t sstf_cost_model_store(struct elevator_queue *e, 
+				     const char *page, size_t count)
+{
+	struct sstf_data *nd = e->elevator_data;
+	int i = sstf_names_find(sstf_cost_names, SSTF_COST_NR, page);
+
+	if(i < 0) {
+		return i;
+	}
+
+	spin_lock_irq(nd->q->queue_lock);
+	nd->cost_model = i;
+	nd->last_queue = NULL;
+	spin_unlock_irq(nd->q->queue_lock);
+
+	return count;
+}
+
+/*
+ * Measured cost per seek band, as band lower bound (sectors) and mean
+ * service time (usecs). Writing anything starts the calibration over.
+ */
+static ssize_t sstf_band_cost_show(struct elevator_queue *e, char *page)
+{
+	struct sstf_data *nd = e->elevator_data;
+	int len = 0;
+	int i;
+
+	len += sprintf(page + len, "%10s %10s\n", "sectors", "usecs");
+
+	spin_lock_irq(nd->q->queue_lock);
+	for(i = 0; i < SSTF_HIST_BUCKETS; i++) {
+		len += sprintf(page + len, "%10lu %10lu\n",
+				i ? 1UL << (i - 1) : 0UL, nd->band_cost[i]);
+	}
+	spin_unlock_irq(nd->q->queue_lock);
+
+	return len;
+}
+
+static ssize_t sstf_band_cost_store(struct elevator_queue *e, 
+				    const char *page, size_t count)
+{
+	struct sstf_data *nd = e->elevator_data;
+
+	spin_lock_irq(nd->q->queue_lock);
+	memset(nd->band_cost, 0, sizeof(nd->band_cost));
+	spin_unlock_irq(nd->q->queue_lock);
+
+	return count;
+}
+
+/*
+ * Histograms read back as one row per bucket: the bucket's lower bound,
+ * then the read and write counts. Writing anything clears them.
+ */
+static ssize_t sstf_hist_show(struct sstf_data *nd,
+			      unsigned long (*hist)[SSTF_HIST_BUCKETS],
+			      const char *unit, char *page)
+{
+	int len = 0;
+	int i;
+
+	len += sprintf(page + len, "%10s %10s %10s\n", unit, "read", "write");
+
+	spin_lock_irq(nd->q->queue_lock);
+	for(i = 0; i < SSTF_HIST_BUCKETS; i++) {
+		len += sprintf(page + len, "%10lu %10lu %10lu\n",
+				i ? 1UL << (i - 1) : 0UL,
+				hist[READ][i], hist[WRITE][i]);
+	}
+	spin_unlock_irq(nd->q->queue_lock);
+
+	return len;
+}
+
+static void sstf_hist_clear(struct sstf_data *nd,
+			    unsigned long (*hist)[SSTF_HIST_BUCKETS])
+{
+	spin_lock_irq(nd->q->queue_lock);
+	memset(hist, 0, 2 * sizeof(*hist));
+	spin_unlock_irq(nd->q->queue_lock);
+}
+
+static ssize_t sstf_queue_hist_show(struct elevator_queue *e, char *page)
+{
+	struct sstf_data *nd = e->elevator_data;
+	return sstf_hist_show(nd, nd->queue_hist, "usecs", page);
+}
+
+static ssize_t sstf_queue_hist_store(struct elevator_queue *e, 
+				     const char *page, size_t count)
+{
+	struct sstf_data *nd = e->elevator_data;
+	sstf_hist_clear(nd, nd->queue_hist);
+	return count;
+}
+
+static ssize_t sstf_seek_hist_show(struct elevator_queue *e, char *page)
+{
+	struct sstf_data *nd = e->elevator_data;
+	return sstf_hist_show(nd, nd->seek_hist, "sectors", page);
+}
+
+static ssize_t sstf_seek_hist_store(struct elevator_queue *e, 
+				    const char *page, size_t count)
+{
+	struct sstf_data *nd = e->elevator_data;
+	sstf_hist_clear(nd, nd->seek_hist);
+	return count;
+}
+
+/*
+ * Dispatch divides by the zone size, so change it under the queue lock.
+ * Writes already in flight keep their zone slots until they complete.
+ */
+static ssize_t sstf_zone_sectors_store(struct elevator_queue *e, 
+				       const char *page, size_t count)
+{
+	struct sstf_data *nd = e->elevator_data;
+	int __data;
+	int ret = sstf_var_store(&__data, page, count);
+
+	if(__data < 0) {
+		__data = 0;
+	}
+
+	spin_lock_irq(nd->q->queue_lock);
+	nd->zone_sectors = __data;
+	spin_unlock_irq(nd->q->queue_lock);
+
+	return ret;
+}
+
+#define SSTF_ATTR(name) \
+	__ATTR(name, S_IRUGO|S_IWUSR, sstf_##name##_show, \
+				      sstf_##name##_store)
+
+static struct elv_fs_entry sstf_attrs[] = {
+	SSTF_ATTR(policy),
+	SSTF_ATTR(cost_model),
+	SSTF_ATTR(band_cost),
+	SSTF_ATTR(batch_bytes),
+	SSTF_ATTR(batch_gap),
+	SSTF_ATTR(writes_starved),
+	SSTF_ATTR(proc_budget),
+	SSTF_ATTR(antic_expire),
+	SSTF_ATTR(idle_delay),
+	SSTF_ATTR(zone_sectors),
+	SSTF_ATTR(plug_usecs),
+	SSTF_ATTR(plug_depth),
+	SSTF_ATTR(queue_hist),
+	SSTF_ATTR(seek_hist),
+	__ATTR_NULL
+};
+
 static struct elevator_type elevator_sstf = {
 	.ops = {
 		.elevator_allow_merge_fn 	= sstf_merged_requests,
 		.elevator_dispatch_fn		= sstf_dispatch,
 		.elevator_add_req_fn		= sstf_add_request,
+		.elevator_activate_req_fn	= sstf_activate_request,
+		.elevator_deactivate_req_fn	= sstf_deactivate_request,
+		.elevator_completed_req_fn	= sstf_completed_request,
+		.elevator_set_req_fn		= sstf_set_request,
+		.elevator_put_req_fn		= sstf_put_request,
 		.elevator_init_fn		= sstf_init_queue,
 		.elevator_exit_fn		= sstf_exit_queue,
 	},
+	.elevator_attrs = sstf_attrs,
 	.elevator_name = "sstf",
 	.elevator_owner = THIS_MODULE,
 };
@@ -23,7 +23,23 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>	
 #include <linux/bio.h>
+#include <linux/radix-tree.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/topology.h>
+#include <linux/lzo.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/rculist.h>
+#include <linux/sysfs.h>
 #include <linux/crypto.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/scatterlist.h>
+#include <crypto/hash.h>
+#include <asm/uaccess.h>
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -32,9 +48,10 @@ MODULE_LICENSE("Dual BSD/GPL");
  * Global variables
  */
 static char *key = "someweakkey";
-struct crypto_cipher *tfm;
 module_param(key, charp, 0000);
 
+
+
 static int osurd_major = 0;
 module_param(osurd_major, int, 0);
 static int hardsect_size = 512;
@@ -52,357 +69,2772 @@ enum {
 	RM_SIMPLE = 0,
 	RM_FULL = 1,
 	RM_NOQUEUE = 2,
+	RM_MQ = 3,
 };
 static int request_mode = RM_SIMPLE;
 module_param(request_mode, int, 0);
 
+/*
+ * RM_MQ hardware contexts: how many (0 for one per cpu), and how many
+ * bios a context serves per trip through its lock.
+ */
+static int nr_hw_queues = 0;
+module_param(nr_hw_queues, int, 0);
+static int hw_queue_depth = 64;
+module_param(hw_queue_depth, int, 0);
+
+/*
+ * Compressing mode: pages are stored LZO compressed, then encrypted,
+ * and all zero pages take no memory at all.
+ */
+static int compress = 0;
+module_param(compress, int, 0);
+
+/*
+ * Direct access mode: data is stored unencrypted, and file systems that
+ * support it (ext2 -o xip) map the backing pages straight into memory
+ * instead of going through the page cache and this driver.
+ */
+static int dax = 0;
+module_param(dax, int, 0);
+
+/*
+ * Image files: if set, each disk is restored from <image>.<disk name>
+ * at load and saved back there at unload, or on demand through debugfs.
+ */
+static char *image = NULL;
+module_param(image, charp, 0);
+
+/*
+ * Bios larger than this are split into parts of about this size, which
+ * are encrypted in parallel on all cpus. 0 turns it off.
+ */
+static int parallel_bytes = 128 * 1024;
+module_param(parallel_bytes, int, 0);
+static struct workqueue_struct *osurd_wq = NULL;
+
+/*
+ * NUMA placement: numa_node=n0,n1,... puts disk i's memory on node ni,
+ * and its parallel work on that node's cpus. Disks not listed, or
+ * listed as -1, use whatever node they're served from.
+ */
+#define OSURD_MAX_NODE_MAP 16
+static int numa_node[OSURD_MAX_NODE_MAP];
+static int nr_numa_node = 0;
+module_param_array(numa_node, int, &nr_numa_node, 0);
+
+/*
+ * Huge chunks: backing pages are carved out of 2 MiB physically
+ * contiguous blocks, so data written together sits together.
+ */
+static int huge_chunks = 0;
+module_param(huge_chunks, int, 0);
+
 
 #define OSURD_MINORS 16
 #define MINOR_SHIFT 4
 #define DEVNUM(kdevnum) (MINOR(kdev_t_to_nr(kdevnum)) >> MINOR_SHIFT
-#define OSU_CIPHER "aes"
+#define OSU_CIPHER "xts(aes)"
+#define OSU_KEY_HASH "sha256"
+#define OSU_KEY_SIZE 32
+#define OSU_IV_SIZE 16
 #define KERNEL_SECTOR_SIZE 512
+#define PAGE_SECTORS_SHIFT (PAGE_SHIFT - 9)
+#define PAGE_SECTORS (1 << PAGE_SECTORS_SHIFT)
 #define INVALIDATE_DELAY 30*HZ
+#define OSURD_LOCK_STRIPES 64
+#define OSURD_CHUNK_ORDER (21 - PAGE_SHIFT)
+#define OSURD_MAX_SECTORS 8192		/* 4 MiB per request */
+#define OSURD_MAX_SEGMENTS 1024
+#define OSURD_MAX_SNAPSHOTS 16
+
+/* the cipher key, derived from the key parameter at load */
+static u8 osurd_key[OSU_KEY_SIZE];
+
+/* compressed pages larger than this are stored uncompressed */
+#define OSURD_ZMAX (PAGE_SIZE * 3 / 4)
+#define OSURD_ZBUF_SIZE ALIGN(lzo1x_worst_compress(PAGE_SIZE), OSU_IV_SIZE)
+
+
+/*
+ * A hardware context for RM_MQ. Submitting cpus map onto contexts, and
+ * whoever finds a context idle serves it on their own cpu until it runs
+ * dry, picking up what other cpus mapped to it queued meanwhile.
+ */
+struct osurd_hw_ctx {
+	spinlock_t lock;
+	struct bio_list bios;
+	int running;
+};
 
 
 /*
  * RAM disk device struct
  */
 struct osurd_dev {
-	int size;
-	u8 *data;
+	u64 size;
 	short users;
 	short media_change;
 	spinlock_t lock;
 	struct request_queue *queue;
 	struct gendisk *gd;
 	struct timer_list timer;
+	struct osurd_hw_ctx *hw_ctx;
+	int nr_hw_ctx;
+	int node;	/* NUMA node of the backing memory, or -1 */
+
+	/*
+	 * One cipher handle per cpu, all with the same key, so cpus
+	 * encrypting at once share nothing.
+	 */
+	struct crypto_blkcipher **tfms;
+
+	/*
+	 * Backing pages, allocated on first write and indexed by page
+	 * offset. Lookups are lockless, store_lock serializes changes to
+	 * the tree. A page's contents are guarded by its stripe lock, so
+	 * i/o to different pages runs concurrently.
+	 */
+	spinlock_t store_lock;
+	spinlock_t stripe_lock[OSURD_LOCK_STRIPES];
+	struct radix_tree_root pages;
+
+	/*
+	 * Snapshots share their origin's pages until either side writes,
+	 * see osurd_cow_page(). An origin's epoch counts the snapshots taken
+	 * of it, and its pages keep the epoch they were allocated in as
+	 * their page_private. A snapshot's epoch is the one it was taken
+	 * at, and it sees those origin pages that are older. A snapshot
+	 * and its origin use the origin's stripe locks.
+	 */
+	struct osurd_dev *origin;
+	struct list_head snapshots;	/* taken of this disk */
+	struct list_head snap_list;	/* on the origin's snapshots */
+	unsigned long epoch;
+	spinlock_t *stripes;
+
+	/* what's left of the huge chunk pages are taken from, in order */
+	spinlock_t chunk_lock;
+	struct page *chunk;
+	unsigned int chunk_left;
+
+	/* compressing mode stats, in debugfs */
+	u64 zero_pages;
+	u64 stored_pages;
+	u64 compr_bytes;
+	u64 compress_ns;
+	u64 decompress_ns;
+
+	/* i/o stats, in sysfs under osurd_stats */
+	struct osurd_stats __percpu *stats;
+
+	/* debugfs view of the disk, see osurd_dump_show() */
+	struct dentry *debugfs;
+	u64 dump_start;
+	u32 dump_count;
+	u32 dump_cipher;
 };
 static struct osurd_dev *Devices = NULL;
+static struct dentry *osurd_debugfs = NULL;
+
+/*
+ * Per cpu i/o counters of a disk, summed up for sysfs. The histograms
+ * are log2: bucket i counts values in [2^i, 2^(i+1)), with 0 going to
+ * the first bucket and anything too large to the last.
+ */
+#define OSURD_HIST_BUCKETS 24
+
+struct osurd_stats {
+	u64 ops[2];		/* by data direction */
+	u64 bytes[2];
+	u64 lat_us[2][OSURD_HIST_BUCKETS];
+	u64 sectors[OSURD_HIST_BUCKETS];
+	u64 segments[OSURD_HIST_BUCKETS];
+	u64 cipher_ns;		/* moving data through the cipher */
+	u64 copy_ns;		/* moving it without one */
+};
+
+#define osurd_tfm(dev) ((dev)->tfms[raw_smp_processor_id()])
+#define osurd_stripe(dev, idx) (&(dev)->stripes[(idx) & \
+					(OSURD_LOCK_STRIPES - 1)])
+#define osurd_cow(dev) ((dev)->origin || !list_empty(&(dev)->snapshots))
+
+/* snapshots are made one at a time, and numbered in order */
+static DEFINE_MUTEX(osurd_snap_mutex);
+static int osurd_nr_snapshots = 0;
+
+
+/*
+ * A page of a compressing disk: its LZO output, padded to the cipher
+ * block size and encrypted with the page index as the tweak.
+ */
+struct osurd_zpage {
+	pgoff_t index;
+	u32 len;	/* up to PAGE_SIZE, which may be 64K */
+	u32 flags;
+	u8 data[0];
+};
+#define OSURD_ZPAGE_RAW 1	/* didn't compress, data is the whole page */
+
+/*
+ * All zero pages are kept in the tree as just their index, tagged with
+ * a bit no pointer has.
+ */
+#define OSURD_ZERO_ENTRY 2
+#define osurd_zero_entry(idx) ((void *) (((unsigned long) (idx) << 2) | \
+					 OSURD_ZERO_ENTRY))
+#define osurd_is_zero_entry(entry) ((unsigned long) (entry) & OSURD_ZERO_ENTRY)
+
+/*
+ * Per cpu scratch space for compressing: the plain page, the compressed
+ * one and the compressor's work memory.
+ */
+struct osurd_zwork {
+	u8 *plain;
+	u8 *cbuf;
+	void *wrkmem;
+};
+static struct osurd_zwork __percpu *osurd_zwork = NULL;
 
 
-//Itterates through and prints data.
-static void hexdump(unsigned char *buf, unsigned int len)
+/*
+ * Returns the backing page holding sector, or NULL if nothing in it was
+ * ever written. A snapshot without a page of its own there sees its
+ * origin's, if that was there when the snapshot was taken. The stripe
+ * lock has to be held for that page to stay put.
+ */
+static struct page *osurd_lookup_page(struct osurd_dev *dev, sector_t sector)
 {
-	while(len--) {
-		printk("%02x", *buf++);
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct page *page;
+
+	rcu_read_lock();
+	page = radix_tree_lookup(&dev->pages, idx);
+	if(page == NULL && dev->origin) {
+		page = radix_tree_lookup(&dev->origin->pages, idx);
+		if(page && page_private(page) >= dev->epoch) {
+			page = NULL;
+		}
 	}
-	
-	printk("\n");
+	rcu_read_unlock();
+
+	return page;
 }
 
 
 /*
- * Basic transfer function called by other functions for transfering
- * data from the RAM disk block. Calls the appropriate encrypt and
- * decrypt functions from crytpo. Also calls hexdump in order to
- * dump the entirety of the data to the kernel.
+ * Before an origin's page at idx changes or goes, gives it to every
+ * snapshot that sees it and has no page of its own there. Called under
+ * the stripe lock.
  */
-static void osurd_transfer(struct osurd_dev *dev, unsigned long sector,
-			   unsigned long nsect, char *buffer, int write)
+static int osurd_preserve(struct osurd_dev *dev, pgoff_t idx, 
+			  struct page *page)
 {
-	unsigned long offset = sector *KERNEL_SECTOR_SIZE;
-	unsigned long nbytes = nsect *KERNEL_SECTOR_SIZE;
+	struct osurd_dev *snap;
+	int err = 0;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(snap, &dev->snapshots, snap_list) {
+		if(page_private(page) >= snap->epoch) {
+			continue;
+		}
+
+		spin_lock(&snap->store_lock);
+		if(radix_tree_lookup(&snap->pages, idx) == NULL) {
+			err = radix_tree_insert(&snap->pages, idx, page);
+			if(!err) {
+				get_page(page);
+			}
+		}
+		spin_unlock(&snap->store_lock);
+
+		if(err) {
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return err;
+}
+
+
+/*
+ * Takes the next page of the device's current chunk, if it has one.
+ */
+static struct page *osurd_chunk_take(struct osurd_dev *dev)
+{
+	struct page *page = NULL;
+
+	spin_lock(&dev->chunk_lock);
+	if(dev->chunk_left) {
+		page = dev->chunk++;
+		dev->chunk_left--;
+	}
+	spin_unlock(&dev->chunk_lock);
+
+	return page;
+}
+
+
+/*
+ * Allocates a zeroed backing page on the device's node, from a huge
+ * chunk if those are on. A new chunk is split into ordinary pages, so
+ * each is freed on its own later. Falls back to single pages if no
+ * chunk can be had.
+ */
+static struct page *osurd_alloc_backing(struct osurd_dev *dev, gfp_t gfp)
+{
+	struct page *chunk;
+	struct page *page;
 	int i;
 
-	if((offset + nbytes) > dev->size) {
-		printk(KERN_NOTICE "Beyond-end write (%ld %ld)\n", offset, nbytes);
+	if(!huge_chunks) {
+		return alloc_pages_node(dev->node, gfp | __GFP_ZERO, 0);
+	}
+
+	page = osurd_chunk_take(dev);
+	if(page) {
+		return page;
+	}
+
+	chunk = alloc_pages_node(dev->node, gfp | __GFP_ZERO | __GFP_NOWARN |
+				 __GFP_NORETRY, OSURD_CHUNK_ORDER);
+	if(chunk == NULL) {
+		return alloc_pages_node(dev->node, gfp | __GFP_ZERO, 0);
+	}
+	split_page(chunk, OSURD_CHUNK_ORDER);
+
+	spin_lock(&dev->chunk_lock);
+	if(!dev->chunk_left) {
+		dev->chunk = chunk + 1;
+		dev->chunk_left = (1 << OSURD_CHUNK_ORDER) - 1;
+		page = chunk;
+		chunk = NULL;
+	}
+	spin_unlock(&dev->chunk_lock);
+
+	//someone else refilled it meanwhile
+	if(chunk) {
+		for(i = 0; i < 1 << OSURD_CHUNK_ORDER; i++) {
+			__free_page(chunk + i);
+		}
+
+		page = osurd_chunk_take(dev);
+		if(page == NULL) {
+			page = alloc_pages_node(dev->node, gfp | __GFP_ZERO, 0);
+		}
+	}
+
+	return page;
+}
+
+
+static void osurd_free_chunk(struct osurd_dev *dev)
+{
+	while(dev->chunk_left) {
+		__free_page(dev->chunk++);
+		dev->chunk_left--;
+	}
+}
+
+
+/*
+ * Returns a page at idx that dev alone may write to, for an origin with
+ * snapshots or a snapshot. The origin's page is first preserved for
+ * the snapshots that still see it. A page that's shared after that is
+ * copied, and the copy replaces it; a snapshot without a page of its
+ * own gets a copy of what it sees. Called under the stripe lock, which
+ * keeps other users of the page out. Returns NULL if memory ran out.
+ */
+static struct page *osurd_cow_page(struct osurd_dev *dev, pgoff_t idx)
+{
+	struct page *own, *page, *copy;
+	void **slot;
+
+	rcu_read_lock();
+	own = radix_tree_lookup(&dev->pages, idx);
+	rcu_read_unlock();
+	if(own && !dev->origin && osurd_preserve(dev, idx, own)) {
+		return NULL;
+	}
+	if(own && page_count(own) == 1) {
+		return own;
+	}
+
+	page = own ? own : osurd_lookup_page(dev, idx << PAGE_SECTORS_SHIFT);
+	copy = osurd_alloc_backing(dev, GFP_ATOMIC);
+	if(copy == NULL) {
+		return NULL;
+	}
+	if(page) {
+		copy_highpage(copy, page);
+	}
+	copy->index = idx;
+	set_page_private(copy, ACCESS_ONCE(dev->epoch));
+
+	spin_lock(&dev->store_lock);
+	if(own) {
+		slot = radix_tree_lookup_slot(&dev->pages, idx);
+		radix_tree_replace_slot(slot, copy);
+	}
+	else if(radix_tree_insert(&dev->pages, idx, copy)) {
+		spin_unlock(&dev->store_lock);
+		__free_page(copy);
+		return NULL;
+	}
+	spin_unlock(&dev->store_lock);
+
+	if(own) {
+		__free_page(own);
+	}
+
+	return copy;
+}
+
+
+/*
+ * Returns the backing page holding sector, allocating it if need be.
+ * Pages come zeroed, and an all zero sector reads back as zeros, see
+ * osurd_sector_unwritten(). Returns NULL if memory ran out.
+ */
+static struct page *osurd_insert_page(struct osurd_dev *dev, sector_t sector,
+				      gfp_t gfp)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct page *page;
+	int preloaded = 0;
+
+	if(osurd_cow(dev)) {
+		return osurd_cow_page(dev, idx);
+	}
+
+	page = osurd_lookup_page(dev, sector);
+	if(page) {
+		return page;
+	}
+
+	page = osurd_alloc_backing(dev, gfp);
+	if(page == NULL) {
+		return NULL;
+	}
+
+	if(gfp & __GFP_WAIT) {
+		if(radix_tree_preload(gfp)) {
+			__free_page(page);
+			return NULL;
+		}
+		preloaded = 1;
+	}
+
+	spin_lock(&dev->store_lock);
+	page->index = idx;
+	set_page_private(page, dev->epoch);
+	if(radix_tree_insert(&dev->pages, idx, page)) {
+		//lost a race for it, or out of memory
+		__free_page(page);
+		page = radix_tree_lookup(&dev->pages, idx);
+	}
+	spin_unlock(&dev->store_lock);
+
+	if(preloaded) {
+		radix_tree_preload_end();
+	}
+
+	return page;
+}
+
+
+/*
+ * Frees the backing page holding sector. With secure set its contents
+ * are wiped first, rather than left for the next user of the memory.
+ * Returns 0, or -ENOMEM if the snapshots couldn't be given the page and
+ * it had to stay.
+ */
+static int osurd_free_page(struct osurd_dev *dev, sector_t sector,
+			   int secure)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct page *page;
+
+	spin_lock(osurd_stripe(dev, idx));
+	rcu_read_lock();
+	page = radix_tree_lookup(&dev->pages, idx);
+	rcu_read_unlock();
+	if(page && !list_empty(&dev->snapshots) && 
+	   osurd_preserve(dev, idx, page)) {
+		//the snapshots still need it, so it stays
+		spin_unlock(osurd_stripe(dev, idx));
+		return -ENOMEM;
+	}
+
+	spin_lock(&dev->store_lock);
+	page = radix_tree_delete(&dev->pages, idx);
+	spin_unlock(&dev->store_lock);
+	spin_unlock(osurd_stripe(dev, idx));
+
+	if(page) {
+		//what snapshots kept isn't ours to wipe
+		if(secure && page_count(page) == 1) {
+			clear_highpage(page);
+		}
+		__free_page(page);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Drops a compressed page that has been taken out of the tree.
+ */
+static void osurd_zput(struct osurd_dev *dev, void *entry)
+{
+	struct osurd_zpage *zp = entry;
+
+	if(entry == NULL) {
+		return;
+	}
+
+	if(osurd_is_zero_entry(entry)) {
+		dev->zero_pages--;
 		return;
 	}
 
-	crypto_cipher_clear_flags(tfm, ~0);
-	crypto_cipher_setkey(tfm, key, strlen(key));
+	dev->stored_pages--;
+	dev->compr_bytes -= ALIGN(zp->len, OSU_IV_SIZE);
 
-	if(write) {
-		printk("Writing to RAM disk\n");
-		printk("Pre-encrypted data: ");
-		hexdump(buffer, nbytes);
-		
-		for(i = 0; i < nbytes; i += crypto_cipher_blocksize(tfm)) {
-			memset(dev->data + offset +i, 0, crypto_cipher_blocksize(tfm));
-			crypto_cipher_encrypt_one(tfm, dev->data + offset + i, buffer + i);
+	//they're small, always wiping them keeps secure discard simple
+	kzfree(zp);
+}
+
+
+/*
+ * Returns the page index a store entry sits at.
+ */
+static pgoff_t osurd_entry_index(void *entry)
+{
+	if(!compress) {
+		return ((struct page *) entry)->index;
+	}
+	if(osurd_is_zero_entry(entry)) {
+		return (unsigned long) entry >> 2;
+	}
+
+	return ((struct osurd_zpage *) entry)->index;
+}
+
+
+/*
+ * Frees every backing page of the disk.
+ */
+#define FREE_BATCH 16
+static void osurd_free_pages(struct osurd_dev *dev)
+{
+	void *entries[FREE_BATCH];
+	unsigned long pos = 0;
+	int nr_pages;
+	int i;
+
+	do {
+		nr_pages = radix_tree_gang_lookup(&dev->pages, entries, pos, 
+						  FREE_BATCH);
+
+		for(i = 0; i < nr_pages; i++) {
+			pos = osurd_entry_index(entries[i]);
+			radix_tree_delete(&dev->pages, pos);
+
+			if(!compress) {
+				__free_page(entries[i]);
+			}
+			else {
+				osurd_zput(dev, entries[i]);
+			}
 		}
 
-		printk("Encrypted data: ");
-		hexdump(dev->data + offset, nbytes);
+		pos++;
+	} while(nr_pages == FREE_BATCH);
+}
+
+
+/*
+ * Allocates the pages a write will land in before the transfer, outside
+ * the stripe locks, with gfp. The transfer itself runs atomically.
+ */
+static int osurd_prepare_write(struct osurd_dev *dev, sector_t sector,
+			       unsigned int nsect, gfp_t gfp)
+{
+	sector_t end = sector + nsect;
+
+	//compressed pages are only sized once the data is in hand, and
+	//copies on write are only made under the stripe lock
+	if(compress || osurd_cow(dev)) {
+		return 0;
 	}
-	else {
-		printk("Reading from RAM disk\n");
-		printk("Encrypted data: ");
-		hexdump(dev->data + offset, nbytes);
-	
-		for(i = 0; i < nbytes; i += crypto_cipher_blocksize(tfm)) {
-			crypto_ckpher_decrypt_one(tfm, buffer + i, dev->data + offset + i);
+
+	sector &= ~(sector_t) (PAGE_SECTORS - 1);
+	for(; sector < end; sector += PAGE_SECTORS) {
+		if(osurd_insert_page(dev, sector, gfp) == NULL) {
+			return -ENOMEM;
 		}
-		
-		printk("Decrypted data: ");
-		hexdump(buffer, nbytes);
 	}
+
+	return 0;
 }
 
 
 /*
- * Simply used for requesting a transfer (read or write) of 
- * data from the RAM disk.
+ * Returns 1 if the stored sector is all zeros. That is never the
+ * ciphertext of anything, so such a sector was never written (or was
+ * discarded) and reads as zeros.
  */
-static void osurd_request(struct request_queue *q)
+static int osurd_sector_unwritten(u8 *data)
 {
-	struct request *req;
-	req = blk_fetch_request(q);
-	
-	while(req != NULL) {
-		struct osurd_dev *dev = req->rq_disk->private_data;
-		if(req->cmd_type != REQ_TYPE_FS) {
-			printk(KERN_NOTICE "Skip non-fs request\n");
-			__blk_end_request_all(req, -EIO);
-			continue;
+	unsigned long *p = (unsigned long *) data;
+	int i;
+
+	for(i = 0; i < KERNEL_SECTOR_SIZE / sizeof(long); i++) {
+		if(p[i]) {
+			return 0;
 		}
-		osurd_transfer(dev, blk_rq_pos(req), blk_rq_cur_sectors(req),
-			       req->buffer, rq_data_dir(req)):
-		
-		if(!__blk_end_request_cur(req, 0)) {
-			req = blk_fetch_request(q);
+	}
+
+	return 1;
+}
+
+
+/*
+ * Encrypts or decrypts len bytes between two lowmem buffers.
+ */
+static void osurd_crypt(struct osurd_dev *dev, u8 *dst, u8 *src, 
+			unsigned int len, u64 tweak, int encrypt)
+{
+	struct blkcipher_desc desc;
+	struct scatterlist sg_src, sg_dst;
+	u8 iv[OSU_IV_SIZE];
+
+	memset(iv, 0, sizeof(iv));
+	*(__le64 *) iv = cpu_to_le64(tweak);
+
+	desc.tfm = osurd_tfm(dev);
+	desc.info = iv;
+	desc.flags = 0;
+
+	sg_init_one(&sg_src, src, len);
+	sg_init_one(&sg_dst, dst, len);
+
+	if(encrypt) {
+		crypto_blkcipher_encrypt_iv(&desc, &sg_dst, &sg_src, len);
+	}
+	else {
+		crypto_blkcipher_decrypt_iv(&desc, &sg_dst, &sg_src, len);
+	}
+}
+
+
+static int osurd_page_zero(u8 *data)
+{
+	int i;
+
+	for(i = 0; i < PAGE_SECTORS; i++) {
+		if(!osurd_sector_unwritten(data + i * KERNEL_SECTOR_SIZE)) {
+			return 0;
 		}
 	}
+
+	return 1;
+}
+
+
+/*
+ * Reads compressed page idx into w->plain. Called with the page's stripe
+ * lock held, which keeps the entry from being freed under us.
+ */
+static int osurd_zload(struct osurd_dev *dev, pgoff_t idx, 
+		       struct osurd_zwork *w)
+{
+	struct osurd_zpage *zp;
+	void *entry;
+	size_t plen = PAGE_SIZE;
+	ktime_t start;
+	s64 ns;
+	int err;
+
+	rcu_read_lock();
+	entry = radix_tree_lookup(&dev->pages, idx);
+	rcu_read_unlock();
+	zp = entry;
+
+	if(entry == NULL || osurd_is_zero_entry(entry)) {
+		memset(w->plain, 0, PAGE_SIZE);
+		return 0;
+	}
+
+	if(zp->flags & OSURD_ZPAGE_RAW) {
+		osurd_crypt(dev, w->plain, zp->data, PAGE_SIZE, idx, 0);
+		return 0;
+	}
+
+	osurd_crypt(dev, w->cbuf, zp->data, ALIGN(zp->len, OSU_IV_SIZE), idx, 0);
+
+	start = ktime_get();
+	err = lzo1x_decompress_safe(w->cbuf, zp->len, w->plain, &plen);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&dev->store_lock);
+	dev->decompress_ns += ns;
+	spin_unlock(&dev->store_lock);
+
+	if(err != LZO_E_OK || plen != PAGE_SIZE) {
+		printk(KERN_ERR "osurd: page %lu failed to decompress\n", 
+		       (unsigned long) idx);
+		return -EIO;
+	}
+
+	return 0;
 }
 
 
 /*
- * Used for transfering a single bio to a sector. Calls 
- * osurd_tranfer for the actual tranfer to the RAM disk.
+ * Stores w->plain as compressed page idx, replacing what was there.
+ * Called with the page's stripe lock held.
+ */
+static int osurd_zstore(struct osurd_dev *dev, pgoff_t idx, 
+			struct osurd_zwork *w)
+{
+	struct osurd_zpage *zp;
+	void **slot;
+	void *entry;
+	size_t clen;
+	ktime_t start;
+	u8 *src = w->cbuf;
+	int flags = 0;
+	int padded = 0;
+	s64 ns = 0;
+	int err = 0;
+
+	if(osurd_page_zero(w->plain)) {
+		entry = osurd_zero_entry(idx);
+	}
+	else {
+		start = ktime_get();
+		lzo1x_1_compress(w->plain, PAGE_SIZE, w->cbuf, &clen, 
+				 w->wrkmem);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		if(clen > OSURD_ZMAX) {
+			src = w->plain;
+			clen = PAGE_SIZE;
+			flags = OSURD_ZPAGE_RAW;
+		}
+
+		padded = ALIGN(clen, OSU_IV_SIZE);
+		zp = kmalloc_node(sizeof(*zp) + padded, 
+				  GFP_ATOMIC | __GFP_NOWARN, dev->node);
+		if(zp == NULL) {
+			return -ENOMEM;
+		}
+
+		memset(src + clen, 0, padded - clen);
+		zp->index = idx;
+		zp->len = clen;
+		zp->flags = flags;
+		osurd_crypt(dev, zp->data, src, padded, idx, 1);
+		entry = zp;
+	}
+
+	spin_lock(&dev->store_lock);
+	dev->compress_ns += ns;
+
+	slot = radix_tree_lookup_slot(&dev->pages, idx);
+	if(slot) {
+		osurd_zput(dev, *slot);
+		radix_tree_replace_slot(slot, entry);
+	}
+	else if(radix_tree_insert(&dev->pages, idx, entry)) {
+		if(!osurd_is_zero_entry(entry)) {
+			kfree(entry);
+		}
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if(osurd_is_zero_entry(entry)) {
+		dev->zero_pages++;
+	}
+	else {
+		dev->stored_pages++;
+		dev->compr_bytes += padded;
+	}
+
+	out:
+		spin_unlock(&dev->store_lock);
+		return err;
+}
+
+
+static int osurd_hist_bucket(u64 val)
+{
+	int bucket = val ? fls64(val) - 1 : 0;
+
+	return min(bucket, OSURD_HIST_BUCKETS - 1);
+}
+
+
+/*
+ * Counts an i/o of bytes in segs segments that the driver started
+ * serving at start.
+ */
+static void osurd_account(struct osurd_dev *dev, int write, 
+			  unsigned int bytes, unsigned int segs, ktime_t start)
+{
+	u64 us = ktime_to_us(ktime_sub(ktime_get(), start));
+	struct osurd_stats *st;
+
+	st = get_cpu_ptr(dev->stats);
+	st->ops[write]++;
+	st->bytes[write] += bytes;
+	st->lat_us[write][osurd_hist_bucket(us)]++;
+	st->sectors[osurd_hist_bucket(bytes >> 9)]++;
+	st->segments[osurd_hist_bucket(segs)]++;
+	put_cpu_ptr(dev->stats);
+}
+
+
+static u64 osurd_ns_since(ktime_t start)
+{
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+
+static void osurd_account_xfer(struct osurd_dev *dev, u64 cipher_ns, 
+			       u64 copy_ns)
+{
+	struct osurd_stats *st;
+
+	st = get_cpu_ptr(dev->stats);
+	st->cipher_ns += cipher_ns;
+	st->copy_ns += copy_ns;
+	put_cpu_ptr(dev->stats);
+}
+
+
+/*
+ * osurd_transfer() for a compressing disk. Every page touched is
+ * decompressed into per cpu scratch space, and written back compressed
+ * if this is a write. A NULL buffer writes zeros. Loading and storing
+ * pages counts as cipher time, compression included.
+ */
+static int osurd_transfer_compressed(struct osurd_dev *dev, sector_t sector,
+				     unsigned long nsect, char *buffer, 
+				     int write)
+{
+	struct osurd_zwork *w;
+	u64 cipher_ns = 0, copy_ns = 0;
+	ktime_t start;
+	int err = 0;
+
+	while(nsect) {
+		pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+		unsigned int first = sector & (PAGE_SECTORS - 1);
+		unsigned int n = min_t(unsigned long, nsect, 
+				       PAGE_SECTORS - first);
+		u8 *plain;
+
+		//the lock also keeps us on this cpu, and its scratch space ours
+		spin_lock(osurd_stripe(dev, idx));
+		w = this_cpu_ptr(osurd_zwork);
+		plain = w->plain + first * KERNEL_SECTOR_SIZE;
+
+		//a whole page write doesn't need the old contents
+		if(!write || n < PAGE_SECTORS) {
+			start = ktime_get();
+			err = osurd_zload(dev, idx, w);
+			cipher_ns += osurd_ns_since(start);
+			if(err) {
+				spin_unlock(osurd_stripe(dev, idx));
+				break;
+			}
+		}
+
+		start = ktime_get();
+		if(write) {
+			if(buffer) {
+				memcpy(plain, buffer, n * KERNEL_SECTOR_SIZE);
+			}
+			else {
+				memset(plain, 0, n * KERNEL_SECTOR_SIZE);
+			}
+			copy_ns += osurd_ns_since(start);
+
+			start = ktime_get();
+			err = osurd_zstore(dev, idx, w);
+			cipher_ns += osurd_ns_since(start);
+		}
+		else {
+			memcpy(buffer, plain, n * KERNEL_SECTOR_SIZE);
+			copy_ns += osurd_ns_since(start);
+		}
+
+		spin_unlock(osurd_stripe(dev, idx));
+		if(err) {
+			break;
+		}
+
+		if(buffer) {
+			buffer += n * KERNEL_SECTOR_SIZE;
+		}
+		sector += n;
+		nsect -= n;
+	}
+
+	osurd_account_xfer(dev, cipher_ns, copy_ns);
+	return err;
+}
+
+
+static void osurd_free_zpage(struct osurd_dev *dev, sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+
+	spin_lock(osurd_stripe(dev, idx));
+	spin_lock(&dev->store_lock);
+	osurd_zput(dev, radix_tree_delete(&dev->pages, idx));
+	spin_unlock(&dev->store_lock);
+	spin_unlock(osurd_stripe(dev, idx));
+}
+
+
+/*
+ * Drops a range of the disk. Whole pages are freed, partial ones have
+ * their sectors zeroed, so the range reads back as zeros either way.
+ * A secure discard also wipes the freed pages; compressed pages are
+ * always wiped. Returns 0, or -ENOMEM if some of the range couldn't be
+ * dropped and may still read back its old contents.
+ */
+static int osurd_discard(struct osurd_dev *dev, sector_t sector,
+			 unsigned int nsect, int secure)
+{
+	struct page *page;
+	int err = 0;
+
+	while(nsect) {
+		unsigned int first = sector & (PAGE_SECTORS - 1);
+		unsigned int n = min_t(unsigned int, nsect, PAGE_SECTORS - first);
+
+		if(compress) {
+			if(n == PAGE_SECTORS) {
+				osurd_free_zpage(dev, sector);
+			}
+			else {
+				err = osurd_transfer_compressed(dev, sector, n, 
+								NULL, 1);
+			}
+		}
+		else if(n == PAGE_SECTORS && !dev->origin) {
+			err = osurd_free_page(dev, sector, secure);
+		}
+		else {
+			//a snapshot's page is zeroed, not freed, lest the
+			//origin's show through
+			spin_lock(osurd_stripe(dev, sector >> PAGE_SECTORS_SHIFT));
+			page = osurd_lookup_page(dev, sector);
+			if(page && osurd_cow(dev)) {
+				page = osurd_cow_page(dev, 
+						sector >> PAGE_SECTORS_SHIFT);
+				if(page == NULL) {
+					err = -ENOMEM;
+				}
+			}
+			if(page) {
+				memset(page_address(page) + 
+				       first * KERNEL_SECTOR_SIZE, 0,
+				       n * KERNEL_SECTOR_SIZE);
+			}
+			spin_unlock(osurd_stripe(dev, sector >> PAGE_SECTORS_SHIFT));
+		}
+		if(err) {
+			break;
+		}
+
+		sector += n;
+		nsect -= n;
+	}
+
+	return err;
+}
+
+
+/*
+ * Basic transfer function called by other functions for transfering
+ * data from the RAM disk block. Each sector is encrypted or decrypted
+ * in one call, tweaked by its sector number so equal data in different
+ * sectors looks different on the disk. Returns 0, or -errno if the
+ * transfer couldn't be done.
+ */
+static int osurd_transfer(struct osurd_dev *dev, unsigned long sector,
+			  unsigned long nsect, char *buffer, int write)
+{
+	unsigned long offset = sector *KERNEL_SECTOR_SIZE;
+	unsigned long nbytes = nsect *KERNEL_SECTOR_SIZE;
+	struct blkcipher_desc desc;
+	struct scatterlist src, dst;
+	spinlock_t *lock = NULL;
+	u8 iv[OSU_IV_SIZE];
+	unsigned long i;
+	u64 cipher_ns = 0, copy_ns = 0;
+	ktime_t start;
+	int err = 0;
+
+	if((offset + nbytes) > dev->size) {
+		printk(KERN_NOTICE "Beyond-end write (%ld %ld)\n", offset, nbytes);
+		return -EIO;
+	}
+
+	if(compress) {
+		return osurd_transfer_compressed(dev, sector, nsect, buffer, 
+						 write);
+	}
+
+	//the iv lives in the desc, the tfm only holds the key, and in
+	//direct access mode there are no tfms at all
+	if(!dax) {
+		desc.tfm = osurd_tfm(dev);
+		desc.info = iv;
+		desc.flags = 0;
+	}
+
+	//only the cipher and the copies are timed, so waiting on locks
+	//and allocating pages shows in neither
+	for(i = 0; i < nsect; i++) {
+		unsigned int first = (sector + i) & (PAGE_SECTORS - 1);
+		u8 *buf = buffer + i * KERNEL_SECTOR_SIZE;
+		struct page *page;
+
+		//hold the page's stripe while we're in it
+		if(lock != osurd_stripe(dev, (sector + i) >> PAGE_SECTORS_SHIFT)) {
+			if(lock) {
+				spin_unlock(lock);
+			}
+			lock = osurd_stripe(dev, (sector + i) >> PAGE_SECTORS_SHIFT);
+			spin_lock(lock);
+		}
+
+		memset(iv, 0, sizeof(iv));
+		*(__le64 *) iv = cpu_to_le64(sector + i);
+
+		if(write) {
+			//normally allocated already by osurd_prepare_write()
+			page = osurd_insert_page(dev, sector + i, GFP_ATOMIC);
+			if(page == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+
+			if(dax) {
+				start = ktime_get();
+				memcpy(page_address(page) + 
+				       first * KERNEL_SECTOR_SIZE, buf, 
+				       KERNEL_SECTOR_SIZE);
+				copy_ns += osurd_ns_since(start);
+				continue;
+			}
+
+			sg_init_one(&src, buf, KERNEL_SECTOR_SIZE);
+			sg_init_table(&dst, 1);
+			sg_set_page(&dst, page, KERNEL_SECTOR_SIZE, 
+				    first * KERNEL_SECTOR_SIZE);
+			start = ktime_get();
+			crypto_blkcipher_encrypt_iv(&desc, &dst, &src, 
+						    KERNEL_SECTOR_SIZE);
+			cipher_ns += osurd_ns_since(start);
+		}
+		else {
+			page = osurd_lookup_page(dev, sector + i);
+			if(page == NULL || osurd_sector_unwritten(
+				page_address(page) + first * KERNEL_SECTOR_SIZE)) {
+				start = ktime_get();
+				memset(buf, 0, KERNEL_SECTOR_SIZE);
+				copy_ns += osurd_ns_since(start);
+				continue;
+			}
+
+			if(dax) {
+				start = ktime_get();
+				memcpy(buf, page_address(page) + 
+				       first * KERNEL_SECTOR_SIZE, 
+				       KERNEL_SECTOR_SIZE);
+				copy_ns += osurd_ns_since(start);
+				continue;
+			}
+
+			sg_init_table(&src, 1);
+			sg_set_page(&src, page, KERNEL_SECTOR_SIZE, 
+				    first * KERNEL_SECTOR_SIZE);
+			sg_init_one(&dst, buf, KERNEL_SECTOR_SIZE);
+			start = ktime_get();
+			crypto_blkcipher_decrypt_iv(&desc, &dst, &src, 
+						    KERNEL_SECTOR_SIZE);
+			cipher_ns += osurd_ns_since(start);
+		}
+	}
+
+	if(lock) {
+		spin_unlock(lock);
+	}
+
+	osurd_account_xfer(dev, cipher_ns, copy_ns);
+	return err;
+}
+
+
+/*
+ * One line per request, off unless turned on through dynamic debug.
+ */
+static void osurd_trace(struct osurd_dev *dev, int write, sector_t sector,
+			unsigned int nsect)
+{
+	pr_debug("%s: %s %u sectors at %llu\n", dev->gd->disk_name,
+		 write ? "write" : "read", nsect, (unsigned long long) sector);
+}
+
+
+/*
+ * Returns 1 if bio writes nothing but the zero page, which is how
+ * blkdev_issue_zeroout() writes zeros. Those writes are done as a
+ * discard, which reads back as zeros too, without any cipher work.
+ */
+static int osurd_bio_zeroes(struct bio *bio)
+{
+	struct bio_vec *bvec;
+	int i;
+
+	if(bio_data_dir(bio) != WRITE || (bio->bi_rw & REQ_DISCARD) ||
+	   !bio->bi_size) {
+		return 0;
+	}
+
+	bio_for_each_segment(bvec, bio, i) {
+		if(bvec->bv_page != ZERO_PAGE(0)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+/*
+ * Returns 1 if req is to be done as a discard, see osurd_bio_zeroes().
+ */
+static int osurd_rq_discard(struct request *req)
+{
+	struct bio *bio;
+
+	if(req->cmd_flags & REQ_DISCARD) {
+		return 1;
+	}
+	if(req->bio == NULL) {
+		return 0;
+	}
+
+	__rq_for_each_bio(bio, req) {
+		if(!osurd_bio_zeroes(bio)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+/*
+ * Allocates the backing pages the first nsect sectors of a write request
+ * will land in, see osurd_prepare_write(). Called without the queue
+ * lock, but a request_fn still mustn't sleep.
+ */
+static int osurd_prepare_rq(struct osurd_dev *dev, struct request *req,
+			    unsigned int nsect)
+{
+	if(rq_data_dir(req) != WRITE) {
+		return 0;
+	}
+
+	return osurd_prepare_write(dev, blk_rq_pos(req), nsect, GFP_ATOMIC);
+}
+
+
+/*
+ * Transfers a whole request a segment at a time. The request queue
+ * bounces highmem pages, so every segment is in lowmem.
+ */
+static int osurd_xfer_rq_segments(struct osurd_dev *dev, struct request *req)
+{
+	struct req_iterator iter;
+	struct bio_vec *bvec;
+	sector_t sector = blk_rq_pos(req);
+	int err = 0;
+
+	rq_for_each_segment(bvec, req, iter) {
+		err = osurd_transfer(dev, sector, bvec->bv_len >> 9, 
+				     page_address(bvec->bv_page) + 
+				     bvec->bv_offset, rq_data_dir(req));
+		if(err) {
+			break;
+		}
+		sector += bvec->bv_len >> 9;
+	}
+
+	return err;
+}
+
+
+/*
+ * Simply used for requesting a transfer (read or write) of 
+ * data from the RAM disk. Each request is done and ended whole.
+ */
+static void osurd_request(struct request_queue *q)
+{
+	struct request *req;
+	req = blk_fetch_request(q);
+	
+	while(req != NULL) {
+		struct osurd_dev *dev = req->rq_disk->private_data;
+		ktime_t start;
+		int discard;
+		int err;
+
+		if(req->cmd_type != REQ_TYPE_FS) {
+			printk(KERN_NOTICE "Skip non-fs request\n");
+			__blk_end_request_all(req, -EIO);
+			req = blk_fetch_request(q);
+			continue;
+		}
+		osurd_trace(dev, rq_data_dir(req), blk_rq_pos(req), 
+			    blk_rq_sectors(req));
+		start = ktime_get();
+
+		//the store has its own locks, let other cpus queue meanwhile
+		discard = osurd_rq_discard(req);
+		spin_unlock_irq(q->queue_lock);
+		if(discard) {
+			err = osurd_discard(dev, blk_rq_pos(req), 
+					    blk_rq_sectors(req),
+					    req->cmd_flags & REQ_SECURE);
+		}
+		else {
+			err = osurd_prepare_rq(dev, req, blk_rq_sectors(req));
+			if(!err) {
+				err = osurd_xfer_rq_segments(dev, req);
+			}
+		}
+		spin_lock_irq(q->queue_lock);
+
+		if(!discard) {
+			osurd_account(dev, rq_data_dir(req), blk_rq_bytes(req),
+				      req->nr_phys_segments, start);
+		}
+		__blk_end_request_all(req, err);
+		req = blk_fetch_request(q);
+	}
+}
+
+
+/*
+ * Transfers segments first up to last of a bio, the first of which
+ * starts at sector. Bios are bounced to lowmem before they get here, so
+ * segments that follow each other in memory too, as a clustered page
+ * cache read often does, are transferred in one go.
+ */
+static int osurd_xfer_segments(struct osurd_dev *dev, struct bio *bio,
+			       int first, int last, sector_t sector)
+{
+	int write = bio_data_dir(bio) == WRITE;
+	int i = first;
+	int err = 0;
+
+	while(i < last && !err) {
+		struct bio_vec *bvec = bio_iovec_idx(bio, i);
+		char *buffer = page_address(bvec->bv_page) + bvec->bv_offset;
+		unsigned int len = bvec->bv_len;
+
+		for(i++; i < last; i++) {
+			bvec = bio_iovec_idx(bio, i);
+			if(page_address(bvec->bv_page) + bvec->bv_offset != 
+			   buffer + len) {
+				break;
+			}
+			len += bvec->bv_len;
+		}
+
+		err = osurd_transfer(dev, sector, len >> 9, buffer, write);
+		sector += len >> 9;
+	}
+
+	return err;
+}
+
+
+/*
+ * Used for transfering a single bio to a sector. Calls 
+ * osurd_tranfer for the actual tranfer to the RAM disk.
+ */
+static int osurd_xfer_bio(struct osurd_dev *dev, struct bio *bio)
+{
+	if((bio->bi_rw & REQ_DISCARD) || osurd_bio_zeroes(bio)) {
+		return osurd_discard(dev, bio->bi_sector, bio_sectors(bio), 
+				     bio->bi_rw & REQ_SECURE);
+	}
+
+	return osurd_xfer_segments(dev, bio, bio->bi_idx, bio->bi_vcnt, 
+				   bio->bi_sector);
+}
+
+
+/*
+ * Ends a bio the driver started serving at start.
+ */
+static void osurd_end_bio(struct osurd_dev *dev, struct bio *bio, 
+			  ktime_t start, int err)
+{
+	if(!(bio->bi_rw & REQ_DISCARD)) {
+		osurd_account(dev, bio_data_dir(bio) == WRITE, bio->bi_size, 
+			      bio_segments(bio), start);
+	}
+
+	bio_endio(bio, err);
+}
+
+
+/*
+ * A large bio cut up for encrypting in parallel. Each part is a run of
+ * its segments, and whichever part finishes last ends the bio.
+ */
+struct osurd_part {
+	struct work_struct work;
+	struct osurd_split *split;
+	int first, last;
+	sector_t sector;
+};
+
+struct osurd_split {
+	struct osurd_dev *dev;
+	struct bio *bio;
+	ktime_t start;
+	atomic_t remaining;
+	int err;
+	struct osurd_part parts[0];
+};
+
+
+static void osurd_part_done(struct osurd_part *part, int err)
+{
+	struct osurd_split *split = part->split;
+
+	if(err) {
+		split->err = err;
+	}
+
+	if(atomic_dec_and_test(&split->remaining)) {
+		osurd_end_bio(split->dev, split->bio, split->start, split->err);
+		kfree(split);
+	}
+}
+
+
+static void osurd_part_work(struct work_struct *work)
+{
+	struct osurd_part *part = container_of(work, struct osurd_part, work);
+
+	osurd_part_done(part, osurd_xfer_segments(part->split->dev, 
+			part->split->bio, part->first, part->last, 
+			part->sector));
+}
+
+
+/*
+ * Splits bio into parts of about parallel_bytes on segment boundaries
+ * and hands them out round robin to the online cpus, keeping the last
+ * for this one. A disk placed on a node only uses that node's cpus, if
+ * any are online. Returns 0 if the bio was taken, or -ENOMEM if it has
+ * to be done serially.
+ */
+static int osurd_xfer_parallel(struct osurd_dev *dev, struct bio *bio,
+			       ktime_t start)
+{
+	struct osurd_split *split;
+	struct osurd_part *part;
+	unsigned int bytes = 0;
+	sector_t sector = bio->bi_sector;
+	int nr_parts = DIV_ROUND_UP(bio->bi_size, parallel_bytes);
+	const struct cpumask *cpus = cpu_online_mask;
+	int cpu = raw_smp_processor_id();
+	int i, n = 0;
+
+	if(dev->node >= 0 && cpumask_intersects(cpumask_of_node(dev->node), 
+						cpu_online_mask)) {
+		cpus = cpumask_of_node(dev->node);
+	}
+
+	split = kzalloc(sizeof(*split) + nr_parts * sizeof(*part), GFP_NOIO);
+	if(split == NULL) {
+		return -ENOMEM;
+	}
+
+	split->dev = dev;
+	split->bio = bio;
+	split->start = start;
+
+	part = &split->parts[0];
+	part->first = bio->bi_idx;
+	part->sector = sector;
+	for(i = bio->bi_idx; i < bio->bi_vcnt; i++) {
+		unsigned int len = bio_iovec_idx(bio, i)->bv_len;
+
+		if(bytes >= parallel_bytes) {
+			part->last = i;
+			part = &split->parts[++n];
+			part->first = i;
+			part->sector = sector;
+			bytes = 0;
+		}
+		bytes += len;
+		sector += len >> 9;
+	}
+	part->last = bio->bi_vcnt;
+	nr_parts = n + 1;
+
+	atomic_set(&split->remaining, nr_parts);
+	for(i = 0; i < nr_parts - 1; i++) {
+		part = &split->parts[i];
+		part->split = split;
+		INIT_WORK(&part->work, osurd_part_work);
+
+		cpu = cpumask_next_and(cpu, cpus, cpu_online_mask);
+		if(cpu >= nr_cpu_ids) {
+			cpu = cpumask_next_and(-1, cpus, cpu_online_mask);
+		}
+		queue_work_on(cpu, osurd_wq, &part->work);
+	}
+
+	part = &split->parts[nr_parts - 1];
+	part->split = split;
+	osurd_part_done(part, osurd_xfer_segments(dev, bio, part->first, 
+			part->last, part->sector));
+
+	return 0;
+}
+
+
+/*
+ * Transfers bio and ends it, in parallel if it's large enough. start is
+ * when the driver got the bio.
+ */
+static void osurd_submit_bio(struct osurd_dev *dev, struct bio *bio, 
+			     ktime_t start)
+{
+	if(osurd_wq && !(bio->bi_rw & REQ_DISCARD) && 
+	   bio->bi_size > parallel_bytes && !osurd_bio_zeroes(bio) &&
+	   !osurd_xfer_parallel(dev, bio, start)) {
+		return;
+	}
+
+	osurd_end_bio(dev, bio, start, osurd_xfer_bio(dev, bio));
+}
+
+
+/*
+ * Calls osurd_xfer_bio on each bio in a request, stopping at the first
+ * that fails.
+ */
+static int osurd_xfer_request(struct osurd_dev *dev, struct request *req)
+{
+	struct bio *bio;
+	int err = 0;
+
+	__rq_for_each_bio(bio, req) {
+		err = osurd_xfer_bio(dev, bio);
+		if(err) {
+			break;
+		}
+	}
+	
+	return err;
+}
+
+
+/*
+ * For handling clustering. Each request is done a bio at a time and
+ * ended whole.
+ */
+static void osurd_full_request(struct request_queue *q)
+{
+	struct request *req;
+	int discard;
+	int err;
+	struct osurd_dev *dev = q->queuedata;
+	ktime_t start;
+	req = blk_fetch_request(q);
+	
+	while(req != NULL) {
+		if(req->cmd_type != REQ_TYPE_FS) {
+			printk(KERN_NOTICE "Skip non-fs request\n");
+			__blk_end_request_all(req, -EIO);
+			req = blk_fetch_request(q);
+			continue;
+		}
+
+		osurd_trace(dev, rq_data_dir(req), blk_rq_pos(req), 
+			    blk_rq_sectors(req));
+		start = ktime_get();
+
+		//the store has its own locks, let other cpus queue meanwhile
+		discard = osurd_rq_discard(req);
+		spin_unlock_irq(q->queue_lock);
+		if(discard) {
+			err = osurd_discard(dev, blk_rq_pos(req), 
+					    blk_rq_sectors(req),
+					    req->cmd_flags & REQ_SECURE);
+		}
+		else {
+			err = osurd_prepare_rq(dev, req, blk_rq_sectors(req));
+			if(!err) {
+				err = osurd_xfer_request(dev, req);
+			}
+		}
+		spin_lock_irq(q->queue_lock);
+
+		if(!discard) {
+			osurd_account(dev, rq_data_dir(req), blk_rq_bytes(req),
+				      req->nr_phys_segments, start);
+		}
+		__blk_end_request_all(req, err);
+		req = blk_fetch_request(q);
+	}
+}
+
+
+/*
+ * Allocates the backing pages a bio will write to, see
+ * osurd_prepare_write().
+ */
+static int osurd_prepare_bio(struct osurd_dev *dev, struct bio *bio)
+{
+	if(bio_data_dir(bio) != WRITE || (bio->bi_rw & REQ_DISCARD) ||
+	   osurd_bio_zeroes(bio)) {
+		return 0;
+	}
+
+	return osurd_prepare_write(dev, bio->bi_sector, bio_sectors(bio), 
+				   GFP_NOIO);
+}
+
+
+/*
+ * This directly calls osurd_xfer_bio to make a direct request 
+ * on the RAM disk. It also handles the returned status of the 
+ * request.
+ */
+static int osurd_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct osurd_dev *dev = q->queuedata;
+	ktime_t start = ktime_get();
+	int status;
+	
+	//the cipher needs lowmem pages, same as the request modes get
+	blk_queue_bounce(q, &bio);
+	osurd_trace(dev, bio_data_dir(bio) == WRITE, bio->bi_sector, 
+		    bio_sectors(bio));
+	status = osurd_prepare_bio(dev, bio);
+	if(status) {
+		bio_endio(bio, status);
+		return 0;
+	}
+
+	osurd_submit_bio(dev, bio, start);
+	
+	return 0;
+}
+
+
+/*
+ * RM_MQ submission. The bio joins the queue of the submitting cpu's
+ * context and, unless someone is already serving that context, is served
+ * right here along with anything else that turns up. Contexts share no
+ * lock, so cpus on different contexts never wait on each other.
+ */
+static int osurd_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct osurd_dev *dev = q->queuedata;
+	struct osurd_hw_ctx *ctx;
+	struct bio_list batch;
+	unsigned long flags;
+	int err;
+	int n;
+
+	blk_queue_bounce(q, &bio);
+	ctx = &dev->hw_ctx[raw_smp_processor_id() % dev->nr_hw_ctx];
+
+	//allocating may sleep, so it can't wait until the bio is served
+	err = osurd_prepare_bio(dev, bio);
+	if(err) {
+		bio_endio(bio, err);
+		return 0;
+	}
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	bio_list_add(&ctx->bios, bio);
+	if(ctx->running) {
+		spin_unlock_irqrestore(&ctx->lock, flags);
+		return 0;
+	}
+	ctx->running = 1;
+
+	while(!bio_list_empty(&ctx->bios)) {
+		bio_list_init(&batch);
+		for(n = 0; n < hw_queue_depth && !bio_list_empty(&ctx->bios); 
+		    n++) {
+			bio_list_add(&batch, bio_list_pop(&ctx->bios));
+		}
+		spin_unlock_irqrestore(&ctx->lock, flags);
+
+		while((bio = bio_list_pop(&batch)) != NULL) {
+			//latency is counted from here, not from queueing
+			osurd_trace(dev, bio_data_dir(bio) == WRITE, 
+				    bio->bi_sector, bio_sectors(bio));
+			osurd_submit_bio(dev, bio, ktime_get());
+		}
+
+		spin_lock_irqsave(&ctx->lock, flags);
+	}
+
+	ctx->running = 0;
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	return 0;
+}
+
+
+/*
+ * Sets up the RM_MQ hardware contexts.
+ */
+static int osurd_init_hw_ctx(struct osurd_dev *dev)
+{
+	int i;
+
+	dev->nr_hw_ctx = nr_hw_queues;
+	if(dev->nr_hw_ctx <= 0 || dev->nr_hw_ctx > nr_cpu_ids) {
+		dev->nr_hw_ctx = nr_cpu_ids;
+	}
+
+	dev->hw_ctx = kcalloc(dev->nr_hw_ctx, sizeof(struct osurd_hw_ctx), 
+			      GFP_KERNEL);
+	if(dev->hw_ctx == NULL) {
+		return -ENOMEM;
+	}
+
+	for(i = 0; i < dev->nr_hw_ctx; i++) {
+		spin_lock_init(&dev->hw_ctx[i].lock);
+		bio_list_init(&dev->hw_ctx[i].bios);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Opens the RAM disk.
+ * This simulates the RAM disk like removable media.
+ */
+static int osurd_open(struct block_device *device, fmode_t mode)
+{
+	struct osurd_dev *dev = device->bd_disk->private_data;
+
+	del_timer_sync(&dev->timer);
+	spin_lock(&dev->lock);
+
+	if(!dev->users) {
+		check_disk_change(device);
+	}
+	
+	dev->users++;
+	spin_unlock(&dev->lock);
+
+	return 0;
+}
+
+
+/*
+ * Closes the RAM disk. Simulating removable media.
+ */
+static int osurd_release(struct gendisk *disk, fmode_t mode)
+{
+	struct osurd_dev *dev = disk->private_data;
+
+	spin_lock(&dev->lock);
+	dev->users--;
+
+	if(!dev->users) {
+		dev->timer.expires = jiffies + INVALIDATE_DELAY;
+		add_timer(&dev->timer);
+	}
+	spin_unlock(&dev->lock);
+
+	return 0;
+}
+
+
+/*
+ * Checks the status of a simulated media change.
+ */
+int osurd_media_changed(struct gendisk *gd)
+{
+	struct osurd_dev *dev = gd->private_data;
+	return dev->media_change;
+}
+
+
+/*
+ * Called after a media change. Lock is not used to
+ * avoid deadlocking with open. Resets media_change
+ * flag.
+ */
+int osurd_revalidate(struct gendisk *gd)
+{
+	struct osurd_dev *dev = gd->private_data;
+
+	//snapshots and their origins never lose their media
+	if(dev->media_change) {
+		dev->media_change = 0;
+		if(!osurd_cow(dev)) {
+			osurd_free_pages(dev);
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Sets the media_change flag to simulate removal of media.
+ */
+void osurd_invalidate(unsigned long ldev)
+{
+	struct osurd_dev *dev = (struct osurd_dev *) ldev;
+
+	spin_lock(&dev->lock);
+	if(dev->users) {
+		printk(KERN_WARNING "osurd: timer check failed\n");
+	}
+	else {
+		dev->media_change = 1;
+	}
+
+	spin_unlock(&dev->lock);
+}
+
+
+/*
+ * Checks geometric elements of a block device. 
+ * Checks the size of the device and sets the appropriate
+ * cylinders, heads, sectors, and start.
+ */
+static int osurd_getgeo(struct block_device *device, struct hd_geometry *geo)
+{
+	struct osurd_dev *dev = device->bd_disk->private_data;
+	long size = (dev->size * (hardsect_size / KERNEL_SECTOR_SIZE));
+	geo->cylinders = (size & ~0x3f) >> 6;
+	geo->heads = 4;
+	geo->sectors = 16;
+	geo->start = 0;
+
+	return 0;
+}
+
+
+/*
+ * The dump file walks dump_count sectors from dump_start, one sector per
+ * seq_file record, printing what the disk holds: the plaintext, or the
+ * ciphertext as stored if dump_cipher is set.
+ */
+static void *osurd_dump_start(struct seq_file *m, loff_t *pos)
+{
+	struct osurd_dev *dev = m->private;
+	u64 sector = dev->dump_start + *pos;
+
+	if(*pos >= dev->dump_count || 
+	   (sector + 1) * KERNEL_SECTOR_SIZE > dev->size) {
+		return NULL;
+	}
+
+	return pos;
+}
+
+
+static void *osurd_dump_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	(*pos)++;
+	return osurd_dump_start(m, pos);
+}
+
+
+static void osurd_dump_stop(struct seq_file *m, void *v)
+{
+}
+
+
+/*
+ * Copies out what the store holds for sector, as is. On a compressing
+ * disk that's the matching slice of the page's encrypted, compressed
+ * form, zero padded past its end.
+ */
+static void osurd_read_stored(struct osurd_dev *dev, sector_t sector, u8 *buf)
+{
+	unsigned int off = (sector & (PAGE_SECTORS - 1)) * KERNEL_SECTOR_SIZE;
+	spinlock_t *lock = osurd_stripe(dev, sector >> PAGE_SECTORS_SHIFT);
+	struct osurd_zpage *zp;
+	struct page *page;
+	unsigned int padded;
+
+	memset(buf, 0, KERNEL_SECTOR_SIZE);
+
+	spin_lock(lock);
+	if(!compress) {
+		page = osurd_lookup_page(dev, sector);
+		if(page) {
+			memcpy(buf, page_address(page) + off, 
+			       KERNEL_SECTOR_SIZE);
+		}
+		spin_unlock(lock);
+		return;
+	}
+
+	rcu_read_lock();
+	zp = radix_tree_lookup(&dev->pages, sector >> PAGE_SECTORS_SHIFT);
+	rcu_read_unlock();
+	if(zp && !osurd_is_zero_entry(zp)) {
+		padded = ALIGN(zp->len, OSU_IV_SIZE);
+		if(off < padded) {
+			memcpy(buf, zp->data + off, 
+			       min_t(unsigned int, padded - off, 
+				     KERNEL_SECTOR_SIZE));
+		}
+	}
+	spin_unlock(lock);
+}
+
+
+static int osurd_dump_show(struct seq_file *m, void *v)
+{
+	struct osurd_dev *dev = m->private;
+	unsigned long sector = dev->dump_start + *(loff_t *) v;
+	unsigned long offset = sector * KERNEL_SECTOR_SIZE;
+	char line[80];
+	u8 *buf;
+	int i;
+
+	buf = kmalloc(KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	if(buf == NULL) {
+		return -ENOMEM;
+	}
+
+	if(dev->dump_cipher) {
+		osurd_read_stored(dev, sector, buf);
+	}
+	else {
+		osurd_transfer(dev, sector, 1, buf, 0);
+	}
+
+	for(i = 0; i < KERNEL_SECTOR_SIZE; i += 16) {
+		hex_dump_to_buffer(buf + i, 16, 16, 1, line, sizeof(line), 0);
+		seq_printf(m, "%08lx: %s\n", offset + i, line);
+	}
+
+	kfree(buf);
+	return 0;
+}
+
+
+static const struct seq_operations osurd_dump_seq_ops = {
+	.start = osurd_dump_start,
+	.next = osurd_dump_next,
+	.stop = osurd_dump_stop,
+	.show = osurd_dump_show
+};
+
+
+static int osurd_dump_open(struct inode *inode, struct file *file)
+{
+	int err = seq_open(file, &osurd_dump_seq_ops);
+
+	if(!err) {
+		((struct seq_file *) file->private_data)->private = 
+							inode->i_private;
+	}
+
+	return err;
+}
+
+
+static const struct file_operations osurd_dump_fops = {
+	.owner = THIS_MODULE,
+	.open = osurd_dump_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release
+};
+
+
+/*
+ * Image files. An image is a header followed by one record per stored
+ * page, in index order, holding the page as stored: ciphertext, or the
+ * encrypted compressed form. Pages that were never written aren't in it.
+ * Reads and writes go through a large buffer to keep the file i/o big
+ * and sequential.
+ */
+#define OSURD_IMAGE_MAGIC "OSURDIMG"
+#define OSURD_IMAGE_VERSION 1
+#define OSURD_IMAGE_BUF (1024 * 1024)
+
+#define OSURD_IMAGE_COMPRESS 1
+#define OSURD_IMAGE_DAX 2
+
+struct osurd_image_hdr {
+	char magic[8];
+	__le32 version;
+	__le32 mode;
+	__le64 size;
+	__le32 page_size;
+	__le32 reserved;
+	u8 key_check[OSU_IV_SIZE];	/* zeros encrypted with tweak ~0 */
+};
+
+#define OSURD_REC_ZERO 1
+#define OSURD_REC_RAW 2
+
+struct osurd_image_rec {
+	__le64 index;
+	__le32 flags;
+	__le32 len;
+};
+
+struct osurd_image {
+	struct file *file;
+	loff_t pos;
+	u8 *buf;
+	size_t len;	/* bytes in buf */
+	size_t used;	/* bytes of them consumed, when reading */
+};
+
+
+static int osurd_image_open(struct osurd_image *img, struct osurd_dev *dev,
+			    int flags)
+{
+	char *path;
+
+	memset(img, 0, sizeof(*img));
+
+	path = kasprintf(GFP_KERNEL, "%s.%s", image, dev->gd->disk_name);
+	if(path == NULL) {
+		return -ENOMEM;
+	}
+
+	img->file = filp_open(path, flags | O_LARGEFILE, 0600);
+	kfree(path);
+	if(IS_ERR(img->file)) {
+		return PTR_ERR(img->file);
+	}
+
+	img->buf = vmalloc(OSURD_IMAGE_BUF);
+	if(img->buf == NULL) {
+		filp_close(img->file, NULL);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+
+static void osurd_image_close(struct osurd_image *img)
+{
+	vfree(img->buf);
+	filp_close(img->file, NULL);
+}
+
+
+static int osurd_image_flush(struct osurd_image *img)
+{
+	mm_segment_t old_fs = get_fs();
+	ssize_t ret;
+
+	if(!img->len) {
+		return 0;
+	}
+
+	set_fs(KERNEL_DS);
+	ret = vfs_write(img->file, img->buf, img->len, &img->pos);
+	set_fs(old_fs);
+
+	if(ret != img->len) {
+		return ret < 0 ? ret : -EIO;
+	}
+
+	img->len = 0;
+	return 0;
+}
+
+
+/*
+ * Returns room for len more bytes in the write buffer, flushing it
+ * first if need be. The bytes only count once osurd_image_commit()ed.
+ */
+static u8 *osurd_image_reserve(struct osurd_image *img, size_t len)
+{
+	if(img->len + len > OSURD_IMAGE_BUF && osurd_image_flush(img)) {
+		return NULL;
+	}
+
+	return img->buf + img->len;
+}
+
+
+static void osurd_image_commit(struct osurd_image *img, size_t len)
+{
+	img->len += len;
+}
+
+
+/*
+ * Reads the next len bytes of the image into dst.
+ */
+static int osurd_image_take(struct osurd_image *img, void *dst, size_t len)
+{
+	mm_segment_t old_fs;
+	ssize_t ret;
+	size_t n;
+
+	while(len) {
+		if(img->used == img->len) {
+			old_fs = get_fs();
+			set_fs(KERNEL_DS);
+			ret = vfs_read(img->file, img->buf, OSURD_IMAGE_BUF, 
+				       &img->pos);
+			set_fs(old_fs);
+
+			if(ret <= 0) {
+				return ret < 0 ? ret : -EIO;
+			}
+			img->len = ret;
+			img->used = 0;
+		}
+
+		n = min(len, img->len - img->used);
+		memcpy(dst, img->buf + img->used, n);
+		img->used += n;
+		dst += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+static void osurd_image_hdr_init(struct osurd_dev *dev, 
+				 struct osurd_image_hdr *hdr)
+{
+	u8 zeros[OSU_IV_SIZE];
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, OSURD_IMAGE_MAGIC, sizeof(hdr->magic));
+	hdr->version = cpu_to_le32(OSURD_IMAGE_VERSION);
+	hdr->mode = cpu_to_le32((compress ? OSURD_IMAGE_COMPRESS : 0) |
+				(dax ? OSURD_IMAGE_DAX : 0));
+	hdr->size = cpu_to_le64(dev->size);
+	hdr->page_size = cpu_to_le32(PAGE_SIZE);
+
+	//lets a restore tell it has the key the image was made with
+	if(!dax) {
+		memset(zeros, 0, sizeof(zeros));
+		osurd_crypt(dev, hdr->key_check, zeros, sizeof(zeros), ~0ULL, 1);
+	}
+}
+
+
+/*
+ * Appends the page at idx to the image, if it's still there.
+ */
+static int osurd_save_page(struct osurd_dev *dev, struct osurd_image *img,
+			   pgoff_t idx)
+{
+	struct osurd_image_rec *rec;
+	struct osurd_zpage *zp;
+	struct page *page;
+	void *entry;
+	size_t len = 0;
+	u8 *p;
+
+	p = osurd_image_reserve(img, sizeof(*rec) + PAGE_SIZE);
+	if(p == NULL) {
+		return -EIO;
+	}
+	rec = (struct osurd_image_rec *) p;
+	rec->index = cpu_to_le64(idx);
+	rec->flags = 0;
+
+	spin_lock(osurd_stripe(dev, idx));
+	rcu_read_lock();
+	entry = radix_tree_lookup(&dev->pages, idx);
+	rcu_read_unlock();
+
+	if(entry == NULL) {
+		spin_unlock(osurd_stripe(dev, idx));
+		return 0;
+	}
+
+	if(!compress) {
+		page = entry;
+		len = PAGE_SIZE;
+		memcpy(rec + 1, page_address(page), len);
+		rec->len = cpu_to_le32(len);
+	}
+	else if(osurd_is_zero_entry(entry)) {
+		rec->flags = cpu_to_le32(OSURD_REC_ZERO);
+		rec->len = 0;
+	}
+	else {
+		zp = entry;
+		if(zp->flags & OSURD_ZPAGE_RAW) {
+			rec->flags = cpu_to_le32(OSURD_REC_RAW);
+		}
+		rec->len = cpu_to_le32(zp->len);
+		len = ALIGN(zp->len, OSU_IV_SIZE);
+		memcpy(rec + 1, zp->data, len);
+	}
+	spin_unlock(osurd_stripe(dev, idx));
+
+	osurd_image_commit(img, sizeof(*rec) + len);
+	return 0;
+}
+
+
+/*
+ * Writes the disk out to its image file. The disk may be in use; each
+ * page is copied under its stripe lock.
+ */
+static int osurd_save(struct osurd_dev *dev)
+{
+	struct osurd_image img;
+	struct osurd_image_hdr *hdr;
+	unsigned long indices[FREE_BATCH];
+	void *entries[FREE_BATCH];
+	unsigned long pos = 0;
+	unsigned long saved = 0;
+	int nr_pages;
+	int err;
+	int i;
+
+	err = osurd_image_open(&img, dev, O_WRONLY | O_CREAT | O_TRUNC);
+	if(err) {
+		return err;
+	}
+
+	hdr = (struct osurd_image_hdr *) osurd_image_reserve(&img, 
+							      sizeof(*hdr));
+	osurd_image_hdr_init(dev, hdr);
+	osurd_image_commit(&img, sizeof(*hdr));
+
+	do {
+		//nothing is deleted from the tree under store_lock
+		spin_lock(&dev->store_lock);
+		nr_pages = radix_tree_gang_lookup(&dev->pages, entries, pos, 
+						  FREE_BATCH);
+		for(i = 0; i < nr_pages; i++) {
+			indices[i] = osurd_entry_index(entries[i]);
+		}
+		spin_unlock(&dev->store_lock);
+
+		for(i = 0; i < nr_pages; i++) {
+			err = osurd_save_page(dev, &img, indices[i]);
+			if(err) {
+				goto out;
+			}
+		}
+
+		saved += nr_pages;
+		if(nr_pages) {
+			pos = indices[nr_pages - 1] + 1;
+		}
+	} while(nr_pages == FREE_BATCH);
+
+	err = osurd_image_flush(&img);
+	if(!err) {
+		printk(KERN_INFO "osurd: saved %lu pages of %s\n", saved, 
+		       dev->gd->disk_name);
+	}
+
+	out:
+		osurd_image_close(&img);
+		return err;
+}
+
+
+/*
+ * Reads one record of the image into the store.
+ */
+static int osurd_restore_page(struct osurd_dev *dev, struct osurd_image *img)
+{
+	struct osurd_image_rec rec;
+	struct osurd_zpage *zp;
+	struct page *page;
+	pgoff_t idx;
+	void *entry;
+	u32 flags, len;
+	int err;
+
+	err = osurd_image_take(img, &rec, sizeof(rec));
+	if(err) {
+		return err;
+	}
+
+	idx = le64_to_cpu(rec.index);
+	flags = le32_to_cpu(rec.flags);
+	len = le32_to_cpu(rec.len);
+	if((u64) idx << PAGE_SHIFT >= dev->size || len > PAGE_SIZE) {
+		return -EINVAL;
+	}
+
+	if(!compress) {
+		if(len != PAGE_SIZE) {
+			return -EINVAL;
+		}
+		page = osurd_alloc_backing(dev, GFP_KERNEL);
+		if(page == NULL) {
+			return -ENOMEM;
+		}
+		page->index = idx;
+		set_page_private(page, 0);
+		err = osurd_image_take(img, page_address(page), PAGE_SIZE);
+		if(err) {
+			__free_page(page);
+			return err;
+		}
+		entry = page;
+	}
+	else if(flags & OSURD_REC_ZERO) {
+		entry = osurd_zero_entry(idx);
+	}
+	else {
+		zp = kmalloc_node(sizeof(*zp) + ALIGN(len, OSU_IV_SIZE), 
+				  GFP_KERNEL, dev->node);
+		if(zp == NULL) {
+			return -ENOMEM;
+		}
+		zp->index = idx;
+		zp->len = len;
+		zp->flags = (flags & OSURD_REC_RAW) ? OSURD_ZPAGE_RAW : 0;
+		err = osurd_image_take(img, zp->data, ALIGN(len, OSU_IV_SIZE));
+		if(err) {
+			kfree(zp);
+			return err;
+		}
+		entry = zp;
+	}
+
+	spin_lock(&dev->store_lock);
+	err = radix_tree_insert(&dev->pages, idx, entry);
+	if(!err && compress) {
+		if(osurd_is_zero_entry(entry)) {
+			dev->zero_pages++;
+		}
+		else {
+			dev->stored_pages++;
+			dev->compr_bytes += ALIGN(len, OSU_IV_SIZE);
+		}
+	}
+	spin_unlock(&dev->store_lock);
+
+	if(err) {
+		if(!compress) {
+			__free_page(entry);
+		}
+		else if(!osurd_is_zero_entry(entry)) {
+			kfree(entry);
+		}
+	}
+
+	return err;
+}
+
+
+/*
+ * Fills the disk from its image file, if there is one. Called before
+ * the disk goes live. Anything wrong with the image leaves the disk
+ * empty.
+ */
+static void osurd_restore(struct osurd_dev *dev)
+{
+	struct osurd_image img;
+	struct osurd_image_hdr hdr, want;
+	unsigned long restored = 0;
+	int err;
+
+	err = osurd_image_open(&img, dev, O_RDONLY);
+	if(err) {
+		if(err != -ENOENT) {
+			printk(KERN_WARNING "osurd: can't open image of %s "
+					    "(%d)\n", dev->gd->disk_name, err);
+		}
+		return;
+	}
+
+	osurd_image_hdr_init(dev, &want);
+	err = osurd_image_take(&img, &hdr, sizeof(hdr));
+	if(!err && memcmp(&hdr, &want, sizeof(hdr))) {
+		printk(KERN_WARNING "osurd: image of %s was made with other "
+				    "settings or another key\n", 
+		       dev->gd->disk_name);
+		err = -EINVAL;
+	}
+
+	while(!err) {
+		//a clean end of file between records is the end
+		if(img.used == img.len && 
+		   img.pos >= i_size_read(img.file->f_mapping->host)) {
+			break;
+		}
+
+		err = osurd_restore_page(dev, &img);
+		if(!err) {
+			restored++;
+		}
+	}
+
+	if(err) {
+		printk(KERN_WARNING "osurd: bad image of %s (%d), starting "
+				    "empty\n", dev->gd->disk_name, err);
+		osurd_free_pages(dev);
+	}
+	else {
+		printk(KERN_INFO "osurd: restored %lu pages of %s\n", 
+		       restored, dev->gd->disk_name);
+	}
+
+	osurd_image_close(&img);
+}
+
+
+static ssize_t osurd_save_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct osurd_dev *dev = file->private_data;
+	int err = osurd_save(dev);
+
+	return err ? err : count;
+}
+
+
+static int osurd_save_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+
+/*
+ * Writing anything to debugfs' save file saves the disk's image.
+ */
+static const struct file_operations osurd_save_fops = {
+	.owner = THIS_MODULE,
+	.open = osurd_save_open,
+	.write = osurd_save_write
+};
+
+
+static int osurd_snapshot(struct osurd_dev *origin);
+
+static ssize_t osurd_snapshot_write(struct file *file, 
+				    const char __user *buf, size_t count, 
+				    loff_t *ppos)
+{
+	struct osurd_dev *dev = file->private_data;
+	int err = osurd_snapshot(dev);
+
+	return err ? err : count;
+}
+
+
+/*
+ * Writing anything to debugfs' snapshot file takes a snapshot of the
+ * disk.
+ */
+static const struct file_operations osurd_snapshot_fops = {
+	.owner = THIS_MODULE,
+	.open = osurd_save_open,
+	.write = osurd_snapshot_write
+};
+
+
+/*
+ * Creates the device's debugfs directory. Debugfs is only a debugging
+ * aid, so failing here doesn't fail the device.
+ */
+static void osurd_debugfs_init(struct osurd_dev *dev)
+{
+	if(osurd_debugfs == NULL) {
+		return;
+	}
+
+	dev->debugfs = debugfs_create_dir(dev->gd->disk_name, osurd_debugfs);
+	if(dev->debugfs == NULL) {
+		return;
+	}
+
+	dev->dump_count = 1;
+	debugfs_create_u64("dump_start", 0600, dev->debugfs, &dev->dump_start);
+	debugfs_create_u32("dump_count", 0600, dev->debugfs, &dev->dump_count);
+	debugfs_create_bool("dump_cipher", 0600, dev->debugfs, 
+			    &dev->dump_cipher);
+	debugfs_create_file("dump", 0400, dev->debugfs, dev, &osurd_dump_fops);
+
+	if(image && !dev->origin) {
+		debugfs_create_file("save", 0200, dev->debugfs, dev, 
+				    &osurd_save_fops);
+	}
+
+	if(!compress && !dax && !dev->origin) {
+		debugfs_create_file("snapshot", 0200, dev->debugfs, dev, 
+				    &osurd_snapshot_fops);
+	}
+
+	if(compress) {
+		debugfs_create_u64("zero_pages", 0400, dev->debugfs, 
+				   &dev->zero_pages);
+		debugfs_create_u64("stored_pages", 0400, dev->debugfs, 
+				   &dev->stored_pages);
+		debugfs_create_u64("compr_bytes", 0400, dev->debugfs, 
+				   &dev->compr_bytes);
+		debugfs_create_u64("compress_ns", 0400, dev->debugfs, 
+				   &dev->compress_ns);
+		debugfs_create_u64("decompress_ns", 0400, dev->debugfs, 
+				   &dev->decompress_ns);
+	}
+}
+
+
+/*
+ * Hands out the backing page at sector for a file system to map, in
+ * direct access mode. The page is allocated if it doesn't exist yet.
+ */
+static int osurd_direct_access(struct block_device *device, sector_t sector,
+			       void **kaddr, unsigned long *pfn)
+{
+	struct osurd_dev *dev = device->bd_disk->private_data;
+	struct page *page;
+
+	if(sector & (PAGE_SECTORS - 1)) {
+		return -EINVAL;
+	}
+	if(sector + PAGE_SECTORS > get_capacity(device->bd_disk)) {
+		return -ERANGE;
+	}
+
+	page = osurd_insert_page(dev, sector, GFP_NOIO);
+	if(page == NULL) {
+		return -ENOMEM;
+	}
+
+	*kaddr = page_address(page);
+	*pfn = page_to_pfn(page);
+
+	return 0;
+}
+
+
+/*
+ * Device operations struct. .direct_access is filled in at load in
+ * direct access mode.
+ */
+static struct block_device_operations osurd_ops = {
+	.owner = THIS_MODULE,
+	.open = osurd_open,
+	.release = osurd_release,
+	.media_changed = osurd_media_changed,
+	.revalidate_disk = osurd_revalidate,
+	.getgeo = osurd_getgeo
+};
+
+
+/*
+ * Sums a counter of struct osurd_stats, at offset off, over all cpus.
  */
-static int osurd_xfer_bio(struct osurd_dev *dev, struct bio *bio)
+static u64 osurd_stat(struct osurd_dev *dev, size_t off)
 {
-	int i;
-	struct bio_vec *bvec;
-	sector_t sector = bio->bi_sector;
+	u64 sum = 0;
+	int cpu;
 
-	bio_for_each_segment(bvec, bio, i) {
-		char *buffer = __bio_kmap_atomic(bio, i, KM_USER0);
-		osurd_transfer(dev, sector, bio_cur_bytes(bio) >> 9,
-			       buffer, bio_data_dir(bio) == WRITE);
-		sector += bio_cur_bytes(bio) >> 9;
-		__bio_kunmap_atomic(bio, KM_USER0);
+	for_each_possible_cpu(cpu) {
+		sum += *(u64 *) ((u8 *) per_cpu_ptr(dev->stats, cpu) + off);
 	}
-	
-	return 0;
+
+	return sum;
 }
 
+#define osurd_stat_of(dev, field) \
+	osurd_stat(dev, offsetof(struct osurd_stats, field))
 
-/*
- * Calls osurd_xfer_bio on each bio in a request.
- */
-static int osurd_xfer_request(struct osurd_dev *dev, struct request *req)
+
+static ssize_t osurd_hist_show(struct osurd_dev *dev, size_t off, char *buf)
 {
-	struct bio *bio;
-	int nsect = 0;
+	ssize_t n = 0;
+	int i;
 
-	__rq_for_each_bio(bio, req) {
-		osurd_xfer_bio(dev, bio);
-		nsect += bio->bi_size / KERNEL_SECTOR_SIZE;
+	for(i = 0; i < OSURD_HIST_BUCKETS; i++) {
+		n += sprintf(buf + n, "%llu%c", 
+			     osurd_stat(dev, off + i * sizeof(u64)),
+			     i == OSURD_HIST_BUCKETS - 1 ? '\n' : ' ');
 	}
-	
-	return nsect;
+
+	return n;
 }
 
 
-/*
- * For handling clustering. 
- */
-static void osurd_full_request(struct request_queue *q)
+static struct osurd_dev *osurd_sysfs_dev(struct device *d)
 {
-	struct request *req;
-	int sectors_xferred;
-	struct osurd_dev *dev = q->queuedata;
-	req = blk_fetch_request(q);
-	
-	while(req != NULL) {
-		if(req->cmd_type != REQ_TYPE_FS) {
-			printk(KERN_NOTICE "Skip non-fs request\n");
-			__blk_end_request_all(req, -EIO);
-			continue;
-		}
-
-		sectors_xferred = osurd_xfer_request(dev, req);
-		if(!__blk_end_request_cur(req, 0)) {
-			blk_fetch_reqest(q);
-		}
-	}
+	return dev_to_disk(d)->private_data;
 }
 
 
-/*
- * This directly calls osurd_xfer_bio to make a direct request 
- * on the RAM disk. It also handles the returned status of the 
- * request.
- */
-static int osurd_make_request(struct request_queue *q, struct bio *bio)
+/* "reads writes" */
+static ssize_t osurd_ops_show(struct device *d, struct device_attribute *attr,
+			      char *buf)
 {
-	struct osurd_dev *dev = q->queuedata;
-	int status;
-	
-	status = osurd_xfer_bio(dev, bio);
-	bio_endio(bio, status);
-	
-	return 0;
+	struct osurd_dev *dev = osurd_sysfs_dev(d);
+
+	return sprintf(buf, "%llu %llu\n", osurd_stat_of(dev, ops[READ]),
+		       osurd_stat_of(dev, ops[WRITE]));
 }
 
 
-/*
- * Opens the RAM disk.
- * This simulates the RAM disk like removable media.
- */
-static int osurd_open(struct block_device *device, fmode_t mode)
+/* "bytes read, bytes written" */
+static ssize_t osurd_bytes_show(struct device *d, 
+				struct device_attribute *attr, char *buf)
 {
-	struct osurd_dev *dev = device->bd_disk->private_data;
+	struct osurd_dev *dev = osurd_sysfs_dev(d);
 
-	del_timer_sync(&dev->timer);
-	spin_lock(&dev->lock);
+	return sprintf(buf, "%llu %llu\n", osurd_stat_of(dev, bytes[READ]),
+		       osurd_stat_of(dev, bytes[WRITE]));
+}
 
-	if(!dev->users) {
-		check_disk_change(device);
-	}
-	
-	dev->users++;
-	spin_unlock(&dev->lock);
 
-	return 0;
+/* the histograms, in microseconds, sectors and segments */
+static ssize_t osurd_read_lat_show(struct device *d, 
+				   struct device_attribute *attr, char *buf)
+{
+	return osurd_hist_show(osurd_sysfs_dev(d), 
+			offsetof(struct osurd_stats, lat_us[READ]), buf);
 }
 
 
-/*
- * Closes the RAM disk. Simulating removable media.
- */
-static int osurd_release(struct gendisk *disk, fmode_t mode)
+static ssize_t osurd_write_lat_show(struct device *d, 
+				    struct device_attribute *attr, char *buf)
 {
-	struct osurd_dev *dev = disk->private_data;
-
-	spin_lock(&dev->lock);
-	dev->users--;
+	return osurd_hist_show(osurd_sysfs_dev(d), 
+			offsetof(struct osurd_stats, lat_us[WRITE]), buf);
+}
 
-	if(!dev->users) {
-		dev->timer.expires = jiffies + INVALIDATE_DELAY;
-		add_timer(&dev->timer);
-	}
-	spin_unlock(&dev->lock);
 
-	return 0;
+static ssize_t osurd_sectors_show(struct device *d, 
+				  struct device_attribute *attr, char *buf)
+{
+	return osurd_hist_show(osurd_sysfs_dev(d), 
+			offsetof(struct osurd_stats, sectors), buf);
 }
 
 
-/*
- * Checks the status of a simulated media change.
- */
-int osurd_media_changed(struct gendisk *gd)
+static ssize_t osurd_segments_show(struct device *d, 
+				   struct device_attribute *attr, char *buf)
 {
-	struct osurd_dev *dev = gd->private_data;
-	return dev->media_change;
+	return osurd_hist_show(osurd_sysfs_dev(d), 
+			offsetof(struct osurd_stats, segments), buf);
 }
 
 
-/*
- * Called after a media change. Lock is not used to
- * avoid deadlocking with open. Resets media_change
- * flag.
- */
-int osurd_revalidate(struct gendisk *gd)
+static ssize_t osurd_cipher_ns_show(struct device *d, 
+				    struct device_attribute *attr, char *buf)
 {
-	struct osurd_dev *dev = gd->private_data;
+	return sprintf(buf, "%llu\n", 
+		       osurd_stat_of(osurd_sysfs_dev(d), cipher_ns));
+}
 
-	if(dev->media_change) {
-		dev->media_change = 0;
-		memset(dev->data, 0, dev->size);
-	}
 
-	return 0;
+static ssize_t osurd_copy_ns_show(struct device *d, 
+				  struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", 
+		       osurd_stat_of(osurd_sysfs_dev(d), copy_ns));
 }
 
+static DEVICE_ATTR(ops, 0444, osurd_ops_show, NULL);
+static DEVICE_ATTR(bytes, 0444, osurd_bytes_show, NULL);
+static DEVICE_ATTR(read_latency_us, 0444, osurd_read_lat_show, NULL);
+static DEVICE_ATTR(write_latency_us, 0444, osurd_write_lat_show, NULL);
+static DEVICE_ATTR(request_sectors, 0444, osurd_sectors_show, NULL);
+static DEVICE_ATTR(request_segments, 0444, osurd_segments_show, NULL);
+static DEVICE_ATTR(cipher_ns, 0444, osurd_cipher_ns_show, NULL);
+static DEVICE_ATTR(copy_ns, 0444, osurd_copy_ns_show, NULL);
+
+static struct attribute *osurd_stats_attrs[] = {
+	&dev_attr_ops.attr,
+	&dev_attr_bytes.attr,
+	&dev_attr_read_latency_us.attr,
+	&dev_attr_write_latency_us.attr,
+	&dev_attr_request_sectors.attr,
+	&dev_attr_request_segments.attr,
+	&dev_attr_cipher_ns.attr,
+	&dev_attr_copy_ns.attr,
+	NULL
+};
 
 /*
- * Sets the media_change flag to simulate removal of media.
+ * /sys/block/osurdX/osurd_stats. Discards aren't counted.
  */
-void osurd_invalidate(unsigned long ldev)
+static struct attribute_group osurd_stats_group = {
+	.name = "osurd_stats",
+	.attrs = osurd_stats_attrs
+};
+
+
+static void osurd_free_tfms(struct osurd_dev *dev)
 {
-	struct osurd_dev *dev = (struct osurd_dev *) ldev;
+	int cpu;
 
-	spin_lock(&dev->lock);
-	if(dev->users || !dev->data) {
-		printk(KERN_WARNING "osurd: timer check failed\n");
+	if(dev->tfms == NULL) {
+		return;
 	}
-	else {
-		dev->media_change = 1;
+
+	for_each_possible_cpu(cpu) {
+		if(dev->tfms[cpu] && !IS_ERR(dev->tfms[cpu])) {
+			crypto_free_blkcipher(dev->tfms[cpu]);
+		}
 	}
 
-	spin_unlock(&dev->lock);
+	kfree(dev->tfms);
+	dev->tfms = NULL;
 }
 
 
 /*
- * Checks geometric elements of a block device. 
- * Checks the size of the device and sets the appropriate
- * cylinders, heads, sectors, and start.
+ * Gives the device a keyed cipher handle for every cpu.
  */
-static int osurd_getgeo(struct block_device *device, struct hd_geometry *geo)
+static int osurd_alloc_tfms(struct osurd_dev *dev)
 {
-	struct osurd_dev *dev = device->bd_disk->private_data;
-	long size = (dev->size * (hardsect_size / KERNEL_SECTOR_SIZE));
-	geo->cylinders = (size & ~0x3f) >> 6;
-	geo->heads = 4;
-	geo->sectors = 16;
-	geo->start = 0;
+	int cpu;
+	int err;
 
-	return 0;
-}
+	dev->tfms = kcalloc(nr_cpu_ids, sizeof(*dev->tfms), GFP_KERNEL);
+	if(dev->tfms == NULL) {
+		return -ENOMEM;
+	}
 
+	for_each_possible_cpu(cpu) {
+		dev->tfms[cpu] = crypto_alloc_blkcipher(OSU_CIPHER, 0, 0);
+		if(IS_ERR(dev->tfms[cpu])) {
+			err = PTR_ERR(dev->tfms[cpu]);
+			goto out_free;
+		}
 
-/*
- * Device operations struct. 
- */
-static struct block_device_operations osurd_ops = {
-	.owner = THIS_MODULE,
-	.open = osurd_open,
-	.release = osurd_release,
-	.media_changed = osurd_media_changed,
-	.revalidate_disk = osurd_revalidate,
-	.getgeo = osurd_getgeo
-};
+		err = crypto_blkcipher_setkey(dev->tfms[cpu], osurd_key, 
+					      sizeof(osurd_key));
+		if(err) {
+			goto out_free;
+		}
+	}
+
+	return 0;
+
+	out_free:
+		osurd_free_tfms(dev);
+		return err;
+}
 
 
 /*
- * For setting up the RAM disk. This function sets the appropriate 
- * amount of memory and allocates it for the RAM disk. It then 
+ * For setting up the RAM disk. This function sets the size of the
+ * RAM disk, whose memory is only allocated as it gets written. It then 
  * determines which request state the system is in and sets up
- * the RAM disk accordingly.
+ * the RAM disk accordingly. With origin set the disk is a snapshot of
+ * it, taken just before the disk goes live.
  */
-static void setup_device(struct osurd_dev *dev, int which)
+static void setup_device(struct osurd_dev *dev, int which, 
+			 struct osurd_dev *origin)
 {
-	memset(dev, 0, sizeof(struct osurd_dev));
-	dev->size = nsectors * hardsect_size;
-	dev->data = vmalloc(dev->size);
+	int i;
 
-	if(dev->data == NULL) {
-		printk(KERN_NOTICE "vmalloc failure.\n");
-		return;
+	memset(dev, 0, sizeof(struct osurd_dev));
+	dev->size = (u64) nsectors * hardsect_size;
+	INIT_LIST_HEAD(&dev->snapshots);
+	dev->origin = origin;
+	dev->stripes = origin ? origin->stripe_lock : dev->stripe_lock;
+
+	dev->node = -1;
+	if(which < nr_numa_node && numa_node[which] >= 0) {
+		if(numa_node[which] < MAX_NUMNODES && 
+		   node_online(numa_node[which])) {
+			dev->node = numa_node[which];
+		}
+		else {
+			printk(KERN_WARNING "osurd: node %d isn't online\n", 
+			       numa_node[which]);
+		}
+	}
+	if(origin) {
+		dev->node = origin->node;
 	}
 
 	spin_lock_init(&dev->lock);
+	spin_lock_init(&dev->store_lock);
+	spin_lock_init(&dev->chunk_lock);
+	for(i = 0; i < OSURD_LOCK_STRIPES; i++) {
+		spin_lock_init(&dev->stripe_lock[i]);
+	}
+	INIT_RADIX_TREE(&dev->pages, GFP_ATOMIC);
 
 	init_timer(&dev->timer);
 	dev->timer.data = (unsigned long) dev;
 	dev->timer.function = osurd_invalidate;
 
+	if(!dax && osurd_alloc_tfms(dev)) {
+		printk(KERN_NOTICE "osurd: cipher allocation failed\n");
+		return;
+	}
+
+	dev->stats = alloc_percpu(struct osurd_stats);
+	if(dev->stats == NULL)
+		goto out_free;
+
 	switch(request_mode) {
 		case RM_NOQUEUE:
 			dev->queue = blk_alloc_queue(GFP_KERNEL);
 			if(dev->queue == NULL)
-				goto out_vfree;
+				goto out_free;
 			blk_queue_make_request(dev->queue, osurd_make_request);
 			break;
 
+		case RM_MQ:
+			if(hw_queue_depth <= 0) {
+				hw_queue_depth = 1;
+			}
+			if(osurd_init_hw_ctx(dev))
+				goto out_free;
+			dev->queue = blk_alloc_queue(GFP_KERNEL);
+			if(dev->queue == NULL)
+				goto out_free;
+			blk_queue_make_request(dev->queue, osurd_mq_make_request);
+			break;
+
 		case RM_FULL:
 			dev->queue = blk_init_queue(osurd_full_request, &dev->lock);
 			if(dev->queue == NULL)
-				goto out_vfree;
+				goto out_free;
 			break;
 		
 		default:
@@ -412,17 +2844,29 @@ static void setup_device(struct osurd_dev *dev, int which)
 		case RM_SIMPLE:
 			dev->queue = blk_init_queue(osurd_request, &dev->lock);
 			if(dev->queue == NULL)
-				goto out_vfree;
+				goto out_free;
 			break;
 	}
 
 	blk_queue_logical_block_size(dev->queue, hardsect_size);
 	dev->queue->queuedata = dev;
 
+	//there's no hardware to limit us, fewer larger requests are cheaper
+	blk_queue_max_hw_sectors(dev->queue, OSURD_MAX_SECTORS);
+	blk_queue_max_segments(dev->queue, OSURD_MAX_SEGMENTS);
+	blk_queue_max_segment_size(dev->queue, UINT_MAX);
+
+	//discarded pages are given back, and read back as zeros
+	dev->queue->limits.discard_granularity = PAGE_SIZE;
+	dev->queue->limits.discard_zeroes_data = 1;
+	blk_queue_max_discard_sectors(dev->queue, UINT_MAX);
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, dev->queue);
+	queue_flag_set_unlocked(QUEUE_FLAG_SECDISCARD, dev->queue);
+
 	dev->gd = alloc_disk(OSURD_MINORS);
 	if(!dev->gd) {
 		printk(KERN_NOTICE "alloc_disk failure\n");
-		goto out_vfree;
+		goto out_free;
 	}
 
 	dev->gd->major = osurd_major;
@@ -431,16 +2875,174 @@ static void setup_device(struct osurd_dev *dev, int which)
 	dev->gd->queue = dev->queue;
 	dev->gd->private_data = dev;
 
-	snprintf(dev->gd->disk_name, 32, "osurd%c", which + 'a');
+	if(origin) {
+		snprintf(dev->gd->disk_name, 32, "%s-snap%d", 
+			 origin->gd->disk_name, which - ndevices);
+	}
+	else {
+		snprintf(dev->gd->disk_name, 32, "osurd%c", which + 'a');
+	}
 	set_capacity(dev->gd, nsectors * (hardsect_size / KERNEL_SECTOR_SIZE));
+	if(image && !origin) {
+		osurd_restore(dev);
+	}
+
+	/*
+	 * The snapshot is taken here: it has to be on the list before the
+	 * epoch moves on, so no origin write that sees the new epoch misses
+	 * it. Writes in flight meanwhile may or may not make it in.
+	 */
+	if(origin) {
+		dev->epoch = origin->epoch + 1;
+		list_add_tail_rcu(&dev->snap_list, &origin->snapshots);
+		smp_wmb();
+		origin->epoch = dev->epoch;
+	}
 	add_disk(dev->gd);
+	if(sysfs_create_group(&disk_to_dev(dev->gd)->kobj, 
+			      &osurd_stats_group)) {
+		printk(KERN_WARNING "osurd: no stats for %s\n", 
+		       dev->gd->disk_name);
+	}
+	osurd_debugfs_init(dev);
 
 	return;
 
-	out_vfree:
-		if(dev->data) {
-			vfree(dev->data);
+	out_free:
+		kfree(dev->hw_ctx);
+		dev->hw_ctx = NULL;
+		free_percpu(dev->stats);
+		dev->stats = NULL;
+		osurd_free_tfms(dev);
+}
+
+
+/*
+ * Takes a snapshot of origin as a new disk. Nothing is copied, so this
+ * takes the same time however full the origin is.
+ */
+static int osurd_snapshot(struct osurd_dev *origin)
+{
+	struct osurd_dev *snap;
+	int err = 0;
+
+	if(compress || dax || origin->origin) {
+		return -EOPNOTSUPP;
+	}
+
+	snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+	if(snap == NULL) {
+		return -ENOMEM;
+	}
+
+	mutex_lock(&osurd_snap_mutex);
+	if(osurd_nr_snapshots == OSURD_MAX_SNAPSHOTS) {
+		err = -ENOSPC;
+		goto out_unlock;
+	}
+
+	setup_device(snap, ndevices + osurd_nr_snapshots, origin);
+	if(snap->gd == NULL) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
+	osurd_nr_snapshots++;
+
+	printk(KERN_INFO "osurd: %s is a snapshot of %s\n", 
+	       snap->gd->disk_name, origin->gd->disk_name);
+
+	out_unlock:
+		mutex_unlock(&osurd_snap_mutex);
+		if(err) {
+			if(snap->queue) {
+				blk_cleanup_queue(snap->queue);
+			}
+			kfree(snap);
+		}
+		return err;
+}
+
+
+/*
+ * Derives the cipher key once for the life of the module. The key
+ * parameter is a passphrase of any length, so it's hashed down to the
+ * size the cipher wants.
+ */
+static int osurd_derive_key(void)
+{
+	struct crypto_shash *hash;
+	struct shash_desc *desc;
+	int err;
+
+	hash = crypto_alloc_shash(OSU_KEY_HASH, 0, 0);
+	if(IS_ERR(hash)) {
+		return PTR_ERR(hash);
+	}
+
+	desc = kmalloc(sizeof(*desc) + crypto_shash_descsize(hash), 
+		       GFP_KERNEL);
+	if(desc == NULL) {
+		crypto_free_shash(hash);
+		return -ENOMEM;
+	}
+
+	desc->tfm = hash;
+	desc->flags = 0;
+	err = crypto_shash_digest(desc, key, strlen(key), osurd_key);
+
+	kfree(desc);
+	crypto_free_shash(hash);
+
+	return err;
+}
+
+
+static void osurd_free_zwork(void)
+{
+	int cpu;
+
+	if(osurd_zwork == NULL) {
+		return;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct osurd_zwork *w = per_cpu_ptr(osurd_zwork, cpu);
+
+		kfree(w->plain);
+		kfree(w->cbuf);
+		vfree(w->wrkmem);
+	}
+
+	free_percpu(osurd_zwork);
+	osurd_zwork = NULL;
+}
+
+
+/*
+ * Allocates the compressing mode's per cpu scratch space.
+ */
+static int osurd_alloc_zwork(void)
+{
+	int cpu;
+
+	osurd_zwork = alloc_percpu(struct osurd_zwork);
+	if(osurd_zwork == NULL) {
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct osurd_zwork *w = per_cpu_ptr(osurd_zwork, cpu);
+
+		w->plain = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		w->cbuf = kmalloc(OSURD_ZBUF_SIZE, GFP_KERNEL);
+		w->wrkmem = vmalloc(LZO1X_MEM_COMPRESS);
+		if(!w->plain || !w->cbuf || !w->wrkmem) {
+			osurd_free_zwork();
+			return -ENOMEM;
 		}
+	}
+
+	return 0;
 }
 
 
@@ -450,59 +3052,133 @@ static void setup_device(struct osurd_dev *dev, int which)
 static int __init osurd_init(void)
 {
 	int i;
-	tfm = crypto_alloc_cipher(OSU_CIPHER, 0, 0);
+	int err;
+
+	err = osurd_derive_key();
+	if(err) {
+		printk(KERN_ERR "osurd: unable to set key\n");
+		return err;
+	}
+
+	//mapped pages have to hold the data as is
+	if(dax) {
+		if(compress) {
+			printk(KERN_WARNING "osurd: compress can't be used "
+					    "with dax, turning it off\n");
+			compress = 0;
+		}
+		osurd_ops.direct_access = osurd_direct_access;
+	}
 
-	if(IS_ERR(tfm)) {
-		printk(KERN_ERR "osurd: cipher allocation failed");
-		return PTR_ERR(tfm);
+	if(compress && osurd_alloc_zwork()) {
+		printk(KERN_ERR "osurd: unable to set up compression\n");
+		return -ENOMEM;
+	}
+
+	//only the bio based modes split bios
+	if(parallel_bytes > 0 && !dax && 
+	   (request_mode == RM_NOQUEUE || request_mode == RM_MQ)) {
+		osurd_wq = alloc_workqueue("osurd", WQ_MEM_RECLAIM, 0);
+		if(osurd_wq == NULL) {
+			printk(KERN_WARNING "osurd: no workqueue, "
+					    "encrypting serially\n");
+		}
 	}
 
 	osurd_major = register_blkdev(osurd_major, "osurd");
 	if(osurd_major <= 0) {
 		printk(KERN_WARNING "osurd: unable to get major number\n");
+		if(osurd_wq) {
+			destroy_workqueue(osurd_wq);
+		}
+		osurd_free_zwork();
 		return -EBUSY;
 	}
 
 	Devices = kmalloc(ndevices * sizeof(struct osurd_dev), GFP_KERNEL);
 	if(Devices == NULL)
 		goto out_unregister;
+
+	osurd_debugfs = debugfs_create_dir("osurd", NULL);
+	if(IS_ERR(osurd_debugfs)) {
+		osurd_debugfs = NULL;
+	}
 	
 	for(i = 0; i < ndevices; i++) {
-		setup_device(Devices + i, i);
+		setup_device(Devices + i, i, NULL);
 	}
 
 	return 0;
 	
 	out_unregister:
-		unregister_blkdev(outrd_major, "osurd");
+		unregister_blkdev(osurd_major, "osurd");
+		if(osurd_wq) {
+			destroy_workqueue(osurd_wq);
+		}
+		osurd_free_zwork();
 		return -ENOMEM;
 }
 
 
+/*
+ * Takes a disk down and frees everything it has.
+ */
+static void osurd_teardown(struct osurd_dev *dev)
+{
+	del_timer_sync(&dev->timer);
+	if(dev->gd) {
+		sysfs_remove_group(&disk_to_dev(dev->gd)->kobj, 
+				   &osurd_stats_group);
+		del_gendisk(dev->gd);
+		//no more i/o can come in, the image is final
+		if(image && !dev->origin && osurd_save(dev)) {
+			printk(KERN_WARNING "osurd: saving image of %s "
+					    "failed\n", dev->gd->disk_name);
+		}
+		put_disk(dev->gd);
+	}
+	if(dev->queue) {
+		blk_cleanup_queue(dev->queue);
+	}
+
+	//pages shared with snapshots or the origin only go with the last
+	osurd_free_pages(dev);
+	osurd_free_chunk(dev);
+	kfree(dev->hw_ctx);
+	free_percpu(dev->stats);
+	osurd_free_tfms(dev);
+}
+
+
 /*
  * For exiting the module.
  */
 static void osurd_exit(void)
 {
+	struct osurd_dev *snap, *next;
 	int i;
+
+	//nothing may read the disks while they go away
+	debugfs_remove_recursive(osurd_debugfs);
+
 	for(i = 0; i < ndevices; i++) {
 		struct osurd_dev *dev = Devices + i;
 
-		del_timer_sync(&dev->timer);
-		if(dev->gd) {
-			del_gendisk(dev->gd);
-			put_disk(dev->gd);
-		}
-		if(dev->queue) {
-			blk_cleanup_queue(dev->queue);
-		}
-		if(dev->data) {
-			vfree(dev->data);
+		list_for_each_entry_safe(snap, next, &dev->snapshots, 
+					 snap_list) {
+			osurd_teardown(snap);
+			list_del(&snap->snap_list);
+			kfree(snap);
 		}
+		osurd_teardown(dev);
 	}
 
 	unregister_blkdev(osurd_major, "osurd");
-	crypto_free_cipher(tfm);
+	if(osurd_wq) {
+		destroy_workqueue(osurd_wq);
+	}
+	osurd_free_zwork();
+	memset(osurd_key, 0, sizeof(osurd_key));
 	kfree(Devices);
 }
 